@@ -17,12 +17,31 @@
 
 int disable_echo(int fd, struct termios *original_termios);
 int restore_echo(int fd, struct termios *original_termios);
-int insert_char_tty(char c);
-int insert_string_tty(const char* str);
-int insert_string_tty_with_escapes(const char* str);
+int insert_char_tty(int fd, char c);
+int insert_string_tty(int fd, const char* str);
+int insert_string_tty_with_escapes(int fd, const char* str);
+static int tty_push(int fd, const char *c);
+
+/* Flow control (-w N): only inject while the tty's input queue (FIONREAD)
+ * holds fewer than tty_watermark bytes, so a slow consumer sets the pace
+ * instead of the line discipline silently dropping what doesn't fit. */
+static int tty_watermark = 0;
+static int tty_room = 0;		// bytes we may push before asking again
+#define FLOW_STALL_MS 3000		// queue not draining for this long: give up
 #ifdef GUI_SUPPORT
+int x11_open(void);
+void x11_close(void);
 int insert_string_x11(const char* str, int escape_mode);
 #endif
+/* X11: characters the keyboard has no key for are typed by briefly
+ * mapping them onto an unused keycode (-u remap, the default), or
+ * skipped (-u drop). The tty path pushes UTF-8 bytes as they are. */
+static int x11_unicode_remap = 1;
+/* X11 pacing: the server holds each key press back x11_delay_ms (XTest's
+ * own delay, so we never sleep), and requests go out every x11_flush_chars
+ * characters instead of one round of XFlush() per key. */
+static int x11_delay_ms = 0;
+static int x11_flush_chars = 64;
 
 int main(int argc, char *argv[]) {
 	int gui_mode = 0;
@@ -30,18 +49,27 @@ int main(int argc, char *argv[]) {
 	int option_end = 0; // Flag to indicate if -- was encountered
 	
 	if (argc < 2) {
-		printf("Usage: %s [-g] [-e|--escapes] [--] <str> [...<strN>>]\n"
+		printf("Usage: %s [-g [-d|--delay MS] [--flush N]] [-u|--unicode drop|remap] [-e|--escapes] [-w|--watermark N] [--] <str> [...<strN>>]\n"
 		       "Insert strings in keyboard buffer (as if you typed them).\n"
 		       "Multiple command line arguments are treated as one long\n"
 		       "space-separated string.inserted,\n"
 		       "\n"
 		       "Options:\n"
 		       "-g          Enable X11 insertion (instead of only working in the current term)\n"
+		       "-d, --delay MS  With -g, hold each key back MS ms (paced by the X server)\n"
+		       "--flush N   With -g, send queued keys to the server every N characters\n"
+		       "             (default 64; 1 sends each key as it's made)\n"
+		       "-u, --unicode drop|remap  With -g, characters no key produces: type them\n"
+		       "             through a spare keycode mapped to them for the run (default),\n"
+		       "             or skip them\n"
 		       "-e, --escapes  Enable escape sequences:\n"
 		       "             \\ooo  - octal value (up to 3 digits)\n"
 		       "             \\xhh  - hex value (exactly 2 digits)\n"
 		       "             \\^c   - control character (c can be upper or lowercase)\n"
 		       "             \\\\    - literal backslash\n"
+		       "-w, --watermark N  Flow control: only insert while fewer than N bytes are\n"
+		       "             waiting in the tty's input queue; stop with an error if it\n"
+		       "             stops draining (instead of losing what doesn't fit)\n"
 		       "--          End option processing (following arguments starting with - will be\n"
 		       "             treated as text to insert, not as options)\n"
 		       "",
@@ -64,6 +92,37 @@ int main(int argc, char *argv[]) {
 		} else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--escapes") == 0) {
 			escape_mode = 1;
 			if (i == start_index) start_index++;
+		} else if ((strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--unicode") == 0) && i + 1 < argc) {
+			if (strcmp(argv[++i], "remap") == 0) {
+				x11_unicode_remap = 1;
+			} else if (strcmp(argv[i], "drop") == 0) {
+				x11_unicode_remap = 0;
+			} else {
+				fprintf(stderr, "Invalid unicode mode: %s\n", argv[i]);
+				return 1;
+			}
+			if (i - 1 == start_index) start_index += 2;
+		} else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--delay") == 0) && i + 1 < argc) {
+			x11_delay_ms = atoi(argv[++i]);
+			if (x11_delay_ms < 0) {
+				fprintf(stderr, "Invalid delay: %s\n", argv[i]);
+				return 1;
+			}
+			if (i - 1 == start_index) start_index += 2;
+		} else if (strcmp(argv[i], "--flush") == 0 && i + 1 < argc) {
+			x11_flush_chars = atoi(argv[++i]);
+			if (x11_flush_chars < 1) {
+				fprintf(stderr, "Invalid flush size: %s\n", argv[i]);
+				return 1;
+			}
+			if (i - 1 == start_index) start_index += 2;
+		} else if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--watermark") == 0) && i + 1 < argc) {
+			tty_watermark = atoi(argv[++i]);
+			if (tty_watermark < 1) {
+				fprintf(stderr, "Invalid watermark: %s\n", argv[i]);
+				return 1;
+			}
+			if (i - 1 == start_index) start_index += 2;
 		} else if (argv[i][0] == '-') {
 			// Unknown option
 			fprintf(stderr, "Unknown option: %s\n", argv[i]);
@@ -97,10 +156,24 @@ int main(int argc, char *argv[]) {
 			close(fd);
 			return 1;
 		}
+		if (tty_watermark) {
+			// Non-canonical while we inject, so FIONREAD counts partial lines
+			// too (restore_echo() puts everything back)
+			struct termios raw_termios;
+			tcgetattr(fd, &raw_termios);
+			raw_termios.c_lflag &= ~ICANON;
+			raw_termios.c_cc[VMIN] = 1;
+			raw_termios.c_cc[VTIME] = 0;
+			tcsetattr(fd, TCSANOW, &raw_termios);
+		}
 	} else {
 #ifndef GUI_SUPPORT
 		fprintf(stderr, "GUI support not compiled in\n");
 		return 1;
+#else
+		// One connection and one keymap read for the whole run
+		if (x11_open() != 0)
+			return 1;
 #endif
 	}
 	
@@ -120,7 +193,7 @@ int main(int argc, char *argv[]) {
 				}
 #endif
 			} else {
-				if (insert_char_tty(' ') != 0) {
+				if (insert_char_tty(fd, ' ') != 0) {
 					result = 1;
 					break;
 				}
@@ -137,12 +210,12 @@ int main(int argc, char *argv[]) {
 #endif
 		} else {
 			if (escape_mode) {
-				if (insert_string_tty_with_escapes(arg) != 0) {
+				if (insert_string_tty_with_escapes(fd, arg) != 0) {
 					result = 1;
 					break;
 				}
 			} else {
-				if (insert_string_tty(arg) != 0) {
+				if (insert_string_tty(fd, arg) != 0) {
 					result = 1;
 					break;
 				}
@@ -150,6 +223,10 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
+#ifdef GUI_SUPPORT
+	if (gui_mode)
+		x11_close();
+#endif
 	// Cleanup TTY mode if needed
 	if (!gui_mode) {
 		if (restore_echo(fd, &original_termios)) {
@@ -192,6 +269,10 @@ int restore_echo(int fd, struct termios *original_termios) {
 	return 0;
 }
 
+static int hex_value(char c) {
+	return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
 // Function to convert escape sequences in strings
 char* process_escape_sequences(const char* input, int* error) {
 	if (!input) return NULL;
@@ -205,7 +286,14 @@ char* process_escape_sequences(const char* input, int* error) {
 	
 	size_t i = 0, j = 0;
 	while (i < len) {
-		if (input[i] == '\\' && i + 1 < len) {
+		// Copy everything up to the next backslash in one go
+		const char *bs = memchr(input + i, '\\', len - i);
+		size_t run = bs ? (size_t)(bs - input) - i : len - i;
+		memcpy(output + j, input + i, run);
+		i += run;
+		j += run;
+		if (i >= len) break;
+		if (i + 1 < len) {
 			if (input[i+1] == '\\') {
 				// Literal backslash
 				output[j++] = '\\';
@@ -228,15 +316,7 @@ char* process_escape_sequences(const char* input, int* error) {
 					  isxdigit((unsigned char)input[i+2]) && 
 					  isxdigit((unsigned char)input[i+3])) {
 				// Hex escape sequence \xhh
-				char hex[3] = {input[i+2], input[i+3], '\0'};
-				int value;
-				if (sscanf(hex, "%x", &value) != 1) {
-					fprintf(stderr, "Error: Invalid hex escape sequence '\\x%s'\n", hex);
-					*error = EINVAL;
-					free(output);
-					return NULL;
-				}
-				output[j++] = (char)value;
+				output[j++] = (char)(hex_value(input[i+2]) * 16 + hex_value(input[i+3]));
 				i += 4;
 			} else if (input[i+1] >= '0' && input[i+1] <= '7') {
 				// Octal escape sequence \ooo (up to 3 digits)
@@ -381,142 +461,279 @@ int insert_text_tty(int argc, char *argv[], int escape_mode) {
 }
 
 #ifdef GUI_SUPPORT
-int insert_string_x11(const char* text, int escape_mode) {
-    // Process escape sequences if needed
-    char* processed_text = NULL;
-    if (escape_mode) {
-        int error = 0;
-        processed_text = process_escape_sequences(text, &error);
-        if (error != 0) {
-            return error;
-        }
-        text = processed_text;  // Use the processed text
-    }
-    
-    Display *display = XOpenDisplay(NULL);
-    if (!display) {
-        fprintf(stderr, "Cannot open display\n");
-        if (processed_text) free(processed_text);
-        return 1;
-    }
+/* Byte -> keycode/shift table, built once from the server keymap so the
+ * per-character work is a lookup instead of two scans of the keymap.
+ * Latin-1 keysyms equal their byte value; the first keycode/level found
+ * wins, with odd levels meaning Shift (as before). */
+struct x11_key {
+    KeyCode keycode;
+    unsigned char shift;
+};
+static Display *x11_display;
+static struct x11_key x11_map[256];
+static KeyCode x11_shift_keycode;
+static int x11_pending;                // characters queued since the last XFlush()
 
-    // Retrieve the range of keycodes used by the keyboard
-    int min_keycode, max_keycode;
-    XDisplayKeycodes(display, &min_keycode, &max_keycode);
+// The server keymap, kept for looking up characters beyond Latin-1
+static KeySym *x11_keysyms;
+static int x11_min_keycode, x11_max_keycode, x11_per_keycode;
 
-    // Get the keyboard mapping
-    int keysyms_per_keycode;
+/* Everything else is looked up once per codepoint and cached here
+ * (direct-mapped; keycode 0 caches "no key"). Characters without a key
+ * are put on one of a few unused keycodes, taken round-robin so the last
+ * few stay mapped while clients catch up with the MappingNotify. */
+#define X11_CP_CACHE 256
+#define X11_SPARES 8
+#define X11_RESTORE_DELAY_US 50000
+struct x11_cp {
+    unsigned cp;
+    struct x11_key key;
+};
+static struct x11_cp x11_cp_cache[X11_CP_CACHE];
+static KeyCode x11_spare[X11_SPARES];
+static int x11_nspare, x11_next_spare, x11_remapped;
+
+static void build_x11_map(Display *display) {
+    int min_keycode, max_keycode, keysyms_per_keycode;
+    XDisplayKeycodes(display, &min_keycode, &max_keycode);
     KeySym *keymap = XGetKeyboardMapping(display, min_keycode, max_keycode - min_keycode + 1, &keysyms_per_keycode);
+    if (!keymap) return;
 
-    // Simulate keypresses for each character in the string
-    for (const char *p = text; *p != '\0'; p++) {
-        KeySym ks = XStringToKeysym((char[]){*p, 0});
-
-        // If XStringToKeysym fails, search the keymap
-        if (ks == NoSymbol) {
-            for (int i = 0; i < (max_keycode - min_keycode + 1) * keysyms_per_keycode; ++i) {
-                if (keymap[i] == *p) {
-                    ks = keymap[i];
-                    break;
-                }
+    for (int kc = min_keycode; kc <= max_keycode; ++kc) {
+        int used = 0;
+        for (int i = 0; i < keysyms_per_keycode; ++i)
+            if (keymap[(kc - min_keycode) * keysyms_per_keycode + i] != NoSymbol) used = 1;
+        if (!used && x11_nspare < X11_SPARES)
+            x11_spare[x11_nspare++] = kc;
+        for (int i = 0; i < keysyms_per_keycode; ++i) {
+            KeySym ks = keymap[(kc - min_keycode) * keysyms_per_keycode + i];
+            int c;
+            if (ks == XK_Return)   c = '\n';
+            else if (ks == XK_Tab) c = '\t';
+            else if (ks > 0 && ks < 256) c = (int)ks;
+            else continue;
+            if (!x11_map[c].keycode) {
+                x11_map[c].keycode = kc;
+                x11_map[c].shift = (i % 2 == 1); // Assumes shift is the only modifier
             }
         }
+    }
+    if (x11_map['\n'].keycode && !x11_map['\r'].keycode)
+        x11_map['\r'] = x11_map['\n'];
 
-        if (ks == NoSymbol) {
-            fprintf(stderr, "No symbol for %c\n", *p);
-            continue;
+    x11_shift_keycode = XKeysymToKeycode(display, XK_Shift_L);
+    x11_keysyms = keymap;
+    x11_min_keycode = min_keycode;
+    x11_max_keycode = max_keycode;
+    x11_per_keycode = keysyms_per_keycode;
+}
+
+/* Next codepoint of UTF-8 text, advancing *p. A malformed byte comes back
+ * as itself (i.e. as Latin-1), so nothing is silently lost. */
+static unsigned utf8_next(const char **p) {
+    const unsigned char *s = (const unsigned char *)*p;
+    unsigned c = s[0];
+    int n = c < 0xc2 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : c < 0xf5 ? 3 : 0;
+    if (!n) {
+        *p += 1;
+        return c;
+    }
+    unsigned cp = c & (0x3f >> n);
+    for (int i = 1; i <= n; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            *p += 1;
+            return c;
         }
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+    *p += n + 1;
+    return cp;
+}
 
-        // Search for the keysym in the keyboard mapping
-        KeyCode keycode = 0;
-        int shift_pressed = 0;
-        for (int kc = min_keycode; kc <= max_keycode; ++kc) {
-            for (int i = 0; i < keysyms_per_keycode; ++i) {
-                if (keymap[(kc - min_keycode) * keysyms_per_keycode + i] == ks) {
-                    keycode = kc;
-                    shift_pressed = (i % 2 == 1); // Assumes shift is the only modifier
-                    goto found;
-                }
+// Put cp's keysym on the next spare keycode (both levels, so Shift can't matter)
+static int x11_remap(Display *display, KeySym sym, struct x11_key *k) {
+    if (!x11_nspare) return -1;
+    KeyCode kc = x11_spare[x11_next_spare++ % x11_nspare];
+    // Forget whichever codepoint the spare held before
+    for (int i = 0; i < X11_CP_CACHE; i++)
+        if (x11_cp_cache[i].key.keycode == kc) x11_cp_cache[i].cp = 0;
+    KeySym syms[2] = { sym, sym };
+    XChangeKeyboardMapping(display, kc, 2, syms, 1);
+    XSync(display, False);
+    x11_remapped = 1;
+    k->keycode = kc;
+    k->shift = 0;
+    return 0;
+}
+
+/* Key for codepoint cp: Latin-1 from the byte table, anything else from
+ * the cache, else from the keymap (its Unicode keysym on the first two
+ * levels; legacy keysyms such as Greek or Cyrillic aren't matched and
+ * get a spare), else a spare keycode. NULL: no way to type it. */
+static const struct x11_key *x11_key_for(Display *display, unsigned cp) {
+    if (cp < 256 && x11_map[cp].keycode) return &x11_map[cp];
+    if (cp < 0x20 || cp == 0x7f) return NULL;
+    struct x11_cp *e = &x11_cp_cache[cp % X11_CP_CACHE];
+    if (e->cp == cp) return e->key.keycode ? &e->key : NULL;
+
+    KeySym sym = cp < 0x100 ? cp : 0x1000000 | cp;
+    struct x11_key k = { 0, 0 };
+    for (int kc = x11_min_keycode; kc <= x11_max_keycode && !k.keycode; kc++)
+        for (int i = 0; i < 2 && i < x11_per_keycode; i++)
+            if (x11_keysyms[(kc - x11_min_keycode) * x11_per_keycode + i] == sym) {
+                k.keycode = kc;
+                k.shift = i;
+                break;
             }
-        }
-        
-    found:
-        if (!keycode) {
-            fprintf(stderr, "No keycode found for symbol %lu\n", (unsigned long)ks);
-            continue;
-        }
+    if (!k.keycode && x11_unicode_remap) x11_remap(display, sym, &k);
+    e->cp = cp;
+    e->key = k;
+    return k.keycode ? &e->key : NULL;
+}
 
-        // Press Shift if needed
-        if (shift_pressed) {
-            KeyCode shift_keycode = XKeysymToKeycode(display, XK_Shift_L);
-            XTestFakeKeyEvent(display, shift_keycode, True, 0);
-        }
+// Give the spare keycodes back their empty mapping
+static void x11_restore_spares(Display *display) {
+    if (!x11_remapped) return;
+    // Let clients read the last keys while the mapping still holds
+    XSync(display, False);
+    usleep(X11_RESTORE_DELAY_US);
+    KeySym none[2] = { NoSymbol, NoSymbol };
+    for (int i = 0; i < x11_nspare; i++)
+        XChangeKeyboardMapping(display, x11_spare[i], 2, none, 1);
+    XSync(display, False);
+    for (int i = 0; i < X11_CP_CACHE; i++)
+        for (int j = 0; j < x11_nspare; j++)
+            if (x11_cp_cache[i].key.keycode == x11_spare[j]) x11_cp_cache[i].cp = 0;
+    x11_remapped = 0;
+}
 
-        // Simulate keypress
-        XTestFakeKeyEvent(display, keycode, True, 0);  // key press
-        XTestFakeKeyEvent(display, keycode, False, 0); // key release
+int x11_open(void) {
+    x11_display = XOpenDisplay(NULL);
+    if (!x11_display) {
+        fprintf(stderr, "Cannot open display\n");
+        return 1;
+    }
+    build_x11_map(x11_display);
+    if (!x11_keysyms) {
+        fprintf(stderr, "Cannot read the keyboard mapping\n");
+        XCloseDisplay(x11_display);
+        x11_display = NULL;
+        return 1;
+    }
+    return 0;
+}
 
-        // Release Shift if it was pressed
-        if (shift_pressed) {
-            KeyCode shift_keycode = XKeysymToKeycode(display, XK_Shift_L);
-            XTestFakeKeyEvent(display, shift_keycode, False, 0);
-        }
+// Send what's queued, wait for the server to play it, and disconnect
+void x11_close(void) {
+    if (!x11_display) return;
+    x11_restore_spares(x11_display);
+    XSync(x11_display, False);
+    XCloseDisplay(x11_display);
+    XFree(x11_keysyms);
+    x11_display = NULL;
+}
 
-        // Flush the output buffer
+static void x11_stroke(Display *display, const struct x11_key *k) {
+    // Only the first event of a stroke is delayed; the rest follow it
+    unsigned long delay = x11_delay_ms;
+    if (k->shift) {
+        XTestFakeKeyEvent(display, x11_shift_keycode, True, delay);
+        delay = 0;
+    }
+    XTestFakeKeyEvent(display, k->keycode, True, delay);
+    XTestFakeKeyEvent(display, k->keycode, False, 0);
+    if (k->shift)
+        XTestFakeKeyEvent(display, x11_shift_keycode, False, 0);
+    if (++x11_pending >= x11_flush_chars) {
         XFlush(display);
+        x11_pending = 0;
+    }
+}
+
+int insert_string_x11(const char* text, int escape_mode) {
+    // Process escape sequences if needed
+    char* processed_text = NULL;
+    if (escape_mode) {
+        int error = 0;
+        processed_text = process_escape_sequences(text, &error);
+        if (error != 0) {
+            return error;
+        }
+        text = processed_text;  // Use the processed text
+    }
+
+    // Queue the keys for each character (UTF-8) in the string
+    for (const char *p = text; *p != '\0'; ) {
+        unsigned cp = utf8_next(&p);
+        const struct x11_key *k = x11_key_for(x11_display, cp);
+        if (!k) {
+            fprintf(stderr, "No keycode found for U+%04X\n", cp);
+            continue;
+        }
+        x11_stroke(x11_display, k);
     }
 
-    XFree(keymap);
-    XCloseDisplay(display);
-    
     if (processed_text) free(processed_text);
     return 0;
 }
 #endif
 
-/* Function to insert a single character into the TTY */
-int insert_char_tty(char c) {
-    int fd = open("/dev/tty", O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        return 1;
+/* TIOCSTI one byte, first waiting for room below the watermark if flow
+ * control is on. FIONREAD is only asked once the room it last reported
+ * is used up, so a fast consumer costs about one extra ioctl per
+ * watermark's worth of bytes. */
+static int tty_push(int fd, const char *c) {
+    if (tty_watermark && tty_room <= 0) {
+        int inq = 0, last = -1, delay_us = 100;
+        long stalled_us = 0;
+        while (ioctl(fd, FIONREAD, &inq) == 0 && inq >= tty_watermark) {
+            if (inq != last) stalled_us = 0;      // draining (or growing): keep waiting
+            last = inq;
+            if (stalled_us >= FLOW_STALL_MS * 1000L) {
+                fprintf(stderr, "Error: %d bytes stuck in the tty input queue; nothing is reading it\n", inq);
+                errno = EAGAIN;
+                return -1;
+            }
+            usleep(delay_us);
+            stalled_us += delay_us;
+            if (delay_us < 10000) delay_us *= 2;
+        }
+        // (without FIONREAD support inq stays 0 and nothing is held back)
+        tty_room = inq < tty_watermark ? tty_watermark - inq : 1;
     }
-    
-    int result = 0;
-    if (ioctl(fd, TIOCSTI, &c) == -1) {
+    if (ioctl(fd, TIOCSTI, c) == -1) return -1;
+    tty_room--;
+    return 0;
+}
+
+/* Function to insert a single character into the TTY (fd: /dev/tty,
+ * opened once by main) */
+int insert_char_tty(int fd, char c) {
+    if (tty_push(fd, &c) == -1) {
         perror("ioctl");
-        result = 1;
+        return 1;
     }
-    
-    close(fd);
-    return result;
+    return 0;
 }
 
 /* Function to insert a string into the TTY */
-int insert_string_tty(const char* str) {
-    int fd = open("/dev/tty", O_RDWR);
-    if (fd == -1) {
-        perror("open");
-        return 1;
-    }
-    
+int insert_string_tty(int fd, const char* str) {
     int result = 0;
     size_t len = strlen(str);
     
     for (size_t i = 0; i < len; i++) {
-        if (ioctl(fd, TIOCSTI, &str[i]) == -1) {
+        if (tty_push(fd, &str[i]) == -1) {
             perror("ioctl");
             result = 1;
             break;
         }
     }
     
-    close(fd);
     return result;
 }
 
 /* Function to process escape sequences and insert the result into the TTY */
-int insert_string_tty_with_escapes(const char* str) {
+int insert_string_tty_with_escapes(int fd, const char* str) {
     int error = 0;
     char* processed = process_escape_sequences(str, &error);
     
@@ -524,7 +741,7 @@ int insert_string_tty_with_escapes(const char* str) {
         return error;
     }
     
-    int result = insert_string_tty(processed);
+    int result = insert_string_tty(fd, processed);
     free(processed);
     return result;
 }
@@ -1,5 +1,8 @@
 /* kinject.c — inject keystrokes via /dev/uinput, with optional escape processing (-e) and Ctrl/Caps lock swap (-x)
- * Usage: kinject [-e|--escapes] [-x|--swap] <string> [...]
+ * Usage: kinject [-e|--escapes] [-x|--swap] [-b|--batch char|word|N] <string> [...]
+ *
+ * The injection engine itself is libkbinsert (libkbinsert.c, kbinsert.h);
+ * this file is the command line, the daemon, the backends and --bench.
  */
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -8,233 +11,2031 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
-#include <ctype.h>
-#include <linux/uinput.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include "kbinsert.h"
+#include "x11.h"
+#include "queue.h"
 
-static int ufd = -1;
-
-// Emit a single input_event to uinput
-typedef struct input_event input_event;
-static int emit(int type, int code, int value) {
-    struct input_event ie = {0};
-    ie.type = type;
-    ie.code = code;
-    ie.value = value;
-    if (write(ufd, &ie, sizeof(ie)) != sizeof(ie)) {
-        perror("write");
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* -s, --stats[=json], $KBINSERT_STATS: the pacing summary and, when this
+ * process did the typing, its profile (phase times, syscalls, write()
+ * latency histogram), as text or as JSON lines on stderr
+ */
+enum { STATS_OFF, STATS_TEXT, STATS_JSON };
+
+static int parse_stats(const char *arg) {
+    if (!arg || !*arg || strcmp(arg, "0") == 0) return STATS_OFF;
+    return strcmp(arg, "json") == 0 ? STATS_JSON : STATS_TEXT;
+}
+
+// A duration from a few ns up, in a unit that keeps it short
+static const char *fmt_ns(long long ns, char *buf, size_t len) {
+    if (ns < 1000) snprintf(buf, len, "%lld ns", ns);
+    else if (ns < 1000000) snprintf(buf, len, "%.3g us", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, len, "%.3g ms", ns / 1e6);
+    else snprintf(buf, len, "%.3g s", ns / 1e9);
+    return buf;
+}
+
+// Upper bound of the bucket holding the q-quantile of the write latencies
+static long long hist_quantile(const struct kbi_prof *pr, long long n, double q) {
+    long long seen = 0;
+    for (int i = 0; i < KBI_HIST; i++) {
+        seen += pr->hist[i];
+        if (seen > 0 && seen >= q * n) return 2LL << i;
+    }
+    return 0;
+}
+
+// Charge the time up to now, then print
+static void print_profile(struct kbi_prof *pr, int mode) {
+    static const char *sys_names[KBI_SYS_COUNT] = { "write", "ioctl", "sleep", "io_uring_enter" };
+    long long writes = 0, total_ns = 0;
+    char a[32], b[32], c[32];
+    kbi_prof_phase(pr, pr->cur);
+    for (int i = 0; i < KBI_HIST; i++) writes += pr->hist[i];
+    for (int i = 0; i < KBI_PH_COUNT; i++) total_ns += pr->phase_ns[i];
+
+    if (mode == STATS_JSON) {
+        fprintf(stderr, "{\"kbinsert\":\"phases\",\"total_ns\":%lld", total_ns);
+        for (int i = 0; i < KBI_PH_COUNT; i++)
+            fprintf(stderr, ",\"%s_ns\":%lld", kbi_phase_name(i), pr->phase_ns[i]);
+        fprintf(stderr, "}\n{\"kbinsert\":\"syscalls\"");
+        for (int i = 0; i < KBI_SYS_COUNT; i++)
+            fprintf(stderr, ",\"%s\":%lld", sys_names[i], pr->calls[i]);
+        fprintf(stderr, ",\"bytes\":%lld}\n{\"kbinsert\":\"write_latency\",\"writes\":%lld,\"buckets\":[",
+                pr->bytes, writes);
+        for (int i = 0, first = 1; i < KBI_HIST; i++) {
+            if (!pr->hist[i]) continue;
+            fprintf(stderr, "%s[%lld,%lld,%lld]", first ? "" : ",", i ? 1LL << i : 0, 2LL << i, pr->hist[i]);
+            first = 0;
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    // Phases, biggest first
+    int order[KBI_PH_COUNT];
+    for (int i = 0; i < KBI_PH_COUNT; i++) order[i] = i;
+    for (int i = 1; i < KBI_PH_COUNT; i++)
+        for (int j = i; j > 0 && pr->phase_ns[order[j]] > pr->phase_ns[order[j - 1]]; j--) {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    fprintf(stderr, "kbinsert: time %s:", fmt_ns(total_ns, a, sizeof(a)));
+    for (int i = 0; i < KBI_PH_COUNT && pr->phase_ns[order[i]] > 0; i++)
+        fprintf(stderr, "%s %s %s", i ? "," : "", kbi_phase_name(order[i]),
+                fmt_ns(pr->phase_ns[order[i]], a, sizeof(a)));
+    fprintf(stderr, "\nkbinsert: syscalls: %lld write (%lld bytes), %lld ioctl, %lld sleep, %lld io_uring_enter\n",
+            pr->calls[KBI_SYS_WRITE], pr->bytes, pr->calls[KBI_SYS_IOCTL],
+            pr->calls[KBI_SYS_SLEEP], pr->calls[KBI_SYS_URING]);
+    if (!writes) return;
+    fprintf(stderr, "kbinsert: write() latency over %lld writes: p50 < %s, p99 < %s, max < %s\n", writes,
+            fmt_ns(hist_quantile(pr, writes, 0.5), a, sizeof(a)),
+            fmt_ns(hist_quantile(pr, writes, 0.99), b, sizeof(b)),
+            fmt_ns(hist_quantile(pr, writes, 1), c, sizeof(c)));
+    long long top = 0;
+    for (int i = 0; i < KBI_HIST; i++) if (pr->hist[i] > top) top = pr->hist[i];
+    for (int i = 0; i < KBI_HIST; i++) {
+        if (!pr->hist[i]) continue;
+        char bar[41];
+        int w = (int)(pr->hist[i] * 40 / top);
+        memset(bar, '#', w ? w : 1);
+        bar[w ? w : 1] = '\0';
+        fmt_ns(i ? 1LL << i : 0, a, sizeof(a));
+        fmt_ns(2LL << i, b, sizeof(b));
+        fprintf(stderr, "kbinsert:   %9s .. %-9s %8lld %s\n", a, b, pr->hist[i], bar);
+    }
+}
+
+// --verify: key events written against those read back from the device
+static void print_verify(const struct kbi_stats *st, int mode) {
+    long long lost = st->keys_sent - st->keys_delivered;
+    if (mode == STATS_JSON)
+        fprintf(stderr, "{\"kbinsert\":\"verify\",\"sent\":%lld,\"delivered\":%lld,\"dropped\":%lld,"
+                "\"retries\":%lld}\n", st->keys_sent, st->keys_delivered, lost, st->retries);
+    else
+        fprintf(stderr, "kbinsert: verified %lld of %lld key events delivered, %lld dropped, %lld write retries\n",
+                st->keys_delivered, st->keys_sent, lost, st->retries);
+}
+
+static void print_pace_stats(const struct kbi_stats *st, int mode) {
+    double secs = st->elapsed_ns / 1e9;
+    if (mode == STATS_JSON) {
+        fprintf(stderr, "{\"kbinsert\":\"pacing\",\"mode\":\"%s\",\"chars\":%lld,\"elapsed_ns\":%lld,"
+                "\"slept_ns\":%lld,\"start_rate\":%.0f,\"end_rate\":%.0f,\"min_rate\":%.0f,"
+                "\"stalls\":%lld,\"drops\":%lld,\"blind\":%d,\"syscalls\":%lld,\"retries\":%lld,"
+                "\"intervals\":%lld",
+                kbi_pace_name(st->mode), st->chars, st->elapsed_ns, st->slept_ns, st->start_rate,
+                st->end_rate, st->min_rate, st->stalls, st->drops, st->blind, st->syscalls, st->retries,
+                st->intervals);
+        // No intervals, no jitter figures: zeros would read as none
+        if (st->intervals)
+            fprintf(stderr, ",\"jitter_p50_ns\":%lld,\"jitter_p99_ns\":%lld,\"jitter_p999_ns\":%lld,"
+                    "\"jitter_max_ns\":%lld", st->jitter_p50_ns, st->jitter_p99_ns, st->jitter_p999_ns,
+                    st->jitter_max_ns);
+        fprintf(stderr, "}\n");
+        if (st->keys_sent) print_verify(st, mode);
+        return;
+    }
+    fprintf(stderr, "kbinsert: %lld chars in %.3f s (%.0f chars/s), %s pacing, slept %.3f s\n",
+            st->chars, secs, secs > 0 ? st->chars / secs : 0.0,
+            kbi_pace_name(st->mode), st->slept_ns / 1e9);
+    if (st->mode == KBI_PACE_ADAPTIVE)
+        fprintf(stderr, "kbinsert: adaptive rate %.0f -> %.0f chars/s (min %.0f), %lld stalls, %lld drops%s\n",
+                st->start_rate, st->end_rate, st->min_rate, st->stalls, st->drops,
+                st->blind ? ", no tty read-back (rate held)" : "");
+    if (st->intervals) {
+        char a[16], b[16], c[16], d[16];
+        fprintf(stderr, "kbinsert: jitter over %lld key intervals: p50 %s, p99 %s, p99.9 %s, max %s\n",
+                st->intervals, fmt_ns(st->jitter_p50_ns, a, sizeof(a)), fmt_ns(st->jitter_p99_ns, b, sizeof(b)),
+                fmt_ns(st->jitter_p999_ns, c, sizeof(c)), fmt_ns(st->jitter_max_ns, d, sizeof(d)));
+    }
+    if (st->keys_sent) print_verify(st, mode);
+    else if (st->retries) fprintf(stderr, "kbinsert: %lld writes retried (device busy)\n", st->retries);
+}
+
+/* Input is processed in CHUNK-sized pieces so memory stays bounded no
+ * matter how large the payload is: a source yields raw pieces (slices of
+ * the joined arguments, or reads from a file/stdin), and kbi_inject()
+ * runs each piece through the escape decoder straight into the device.
+ */
+#define CHUNK 65536
+
+struct source {
+    int fd;                 // stream to read, or -1 for buf
+    const char *buf;
+    size_t len, off;
+    char chunk[CHUNK];
+};
+
+// Next raw piece in *piece; returns its length, 0 at end, -1 on read error
+static ssize_t source_next(struct source *src, const char **piece) {
+    if (src->fd < 0) {
+        size_t n = src->len - src->off < CHUNK ? src->len - src->off : CHUNK;
+        *piece = src->buf + src->off;
+        src->off += n;
+        return n;
+    }
+    ssize_t n;
+    while ((n = read(src->fd, src->chunk, CHUNK)) < 0 && errno == EINTR)
+        ;
+    if (n < 0) perror("read");
+    *piece = src->chunk;
+    return n;
+}
+
+/* Device key sets. A payload known up front (arguments, a regular file)
+ * is dry-run through the injector to find exactly the keys it presses;
+ * otherwise every key the current mapping can produce is registered.
+ * Key sets are also merged into a profile in the cache directory, which
+ * kbinsertd starts from and extends when a request needs more keys.
+ */
+
+// Keys needed to type src, without consuming it. Returns -1 for sources
+// that can't be read twice (pipes).
+static int source_keys(struct kbi_ctx *ctx, struct source *src, struct kbi_keys *ks) {
+    memset(ks, 0, sizeof(*ks));
+    if (src->fd < 0) {
+        kbi_scan(ctx, src->buf, src->len, 1, ks);
+        return 0;
+    }
+    struct stat st;
+    off_t start = lseek(src->fd, 0, SEEK_CUR);
+    ssize_t n;
+    if (fstat(src->fd, &st) < 0 || !S_ISREG(st.st_mode) || start < 0)
         return -1;
+    while ((n = read(src->fd, src->chunk, CHUNK)) > 0)
+        kbi_scan(ctx, src->chunk, n, 0, ks);
+    kbi_scan(ctx, NULL, 0, 1, ks);
+    return lseek(src->fd, start, SEEK_SET) < 0 ? -1 : 0;
+}
+
+static int cache_file(const char *name, char *out, size_t len) {
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(out, len, "%s/kbinsert/%s", xdg, name);
+    else if (home && *home) snprintf(out, len, "%s/.cache/kbinsert/%s", home, name);
+    else return -1;
+    return 0;
+}
+
+// Read cache file name into data if it has the magic and exactly len bytes
+static int cache_fetch(const char *name, const char *magic, void *data, size_t len) {
+    char path[4096], head[8];
+    if (cache_file(name, path, sizeof(path)) < 0) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int ok = read(fd, head, 8) == 8 && memcmp(head, magic, 8) == 0
+          && read(fd, data, len) == (ssize_t)len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Replace cache file name (atomically; errors are ignored, it's a cache)
+static void cache_store(const char *name, const char *magic, const void *data, size_t len) {
+    char path[4096], tmp[4200];
+    if (cache_file(name, path, sizeof(path)) < 0) return;
+    for (char *c = path + 1; *c; c++) {
+        if (*c != '/') continue;
+        *c = '\0';
+        mkdir(path, 0700);
+        *c = '/';
     }
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    int ok = write(fd, magic, 8) == 8 && write(fd, data, len) == (ssize_t)len;
+    if (close(fd) < 0 || !ok || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
+#define PROFILE_MAGIC "KBIKEYS1"
+
+// OR the saved key profile into ks; returns -1 if there is none
+static int profile_load(struct kbi_keys *ks) {
+    struct kbi_keys saved;
+    if (cache_fetch("keys.profile", PROFILE_MAGIC, &saved, sizeof(saved)) < 0) return -1;
+    kbi_keys_union(ks, &saved);
     return 0;
 }
 
-// Process escape sequences: \\, \n, \r, \xhh, \ooo, \^C
-static char* process_escapes(const char *in) {
-    if (!in) return NULL;
-    size_t len = strlen(in);
-    char *out = malloc(len + 1);
-    if (!out) return NULL;
-    size_t i = 0, j = 0;
-    while (i < len) {
-        if (in[i] == '\\' && i + 1 < len) {
-            i++;
-            if (in[i] == 'n')          { out[j++] = '\n'; i++; }
-            else if (in[i] == 'r')     { out[j++] = '\r'; i++; }
-            else if (in[i] == '^' && i + 1 < len) {
-                char c = toupper((unsigned char)in[++i]);
-                if (c >= '@' && c <= '_') {
-                    out[j++] = c - 64;
-                } else {
-                    out[j++] = '^';
-                    out[j++] = c;
-                }
-                i++;
-            }
-            else if (in[i] == 'x' && i + 2 < len && isxdigit((unsigned char)in[i+1]) && isxdigit((unsigned char)in[i+2])) {
-                char hex[3] = { in[i+1], in[i+2], '\0' };
-                int v = 0;
-                sscanf(hex, "%x", &v);
-                out[j++] = (char)v;
-                i += 3;
-            }
-            else if (in[i] >= '0' && in[i] <= '7') {
-                int v = 0, cnt = 0;
-                while (cnt < 3 && i < len && in[i] >= '0' && in[i] <= '7') {
-                    v = v * 8 + (in[i] - '0');
-                    i++; cnt++;
+// Merge ks into the saved profile
+static void profile_save(const struct kbi_keys *ks) {
+    struct kbi_keys merged = *ks, old = { { 0 } };
+    if (profile_load(&old) == 0 && kbi_keys_covers(&old, ks)) return;
+    kbi_keys_union(&merged, &old);
+    cache_store("keys.profile", PROFILE_MAGIC, &merged, sizeof(merged));
+}
+
+// Keep the current device if it has every needed key, else recreate it
+// with the union (and remember the union in the profile)
+static int ensure_device(struct kbi_ctx *ctx, const struct kbi_keys *need) {
+    int rc = kbi_open(ctx, need);
+    if (rc > 0) profile_save(kbi_device_keys(ctx));
+    return rc < 0 ? -1 : 0;
+}
+
+/* Daemon mode (kbinsertd): keep one uinput device alive and serve
+ * injection requests from kbinsert clients over a Unix domain socket.
+ * A request is a series of frames, each a kbi_req header followed by len
+ * (<= CHUNK) bytes of raw, not yet escape-processed text; KBI_F_MORE
+ * marks all but the last frame. The reply is a kbi_reply. For adaptive
+ * pacing the client passes its tty along with the first header (SCM_RIGHTS).
+ * A KBI_F_REPLAY request is a single frame holding the absolute path of a
+ * macro file; its own pacing applies unless KBI_F_RATE is set.
+ */
+#define KBI_MAGIC   0x4b42494eu  /* "KBIN" */
+enum { KBI_F_ESCAPES = 1, KBI_F_SWAP = 2, KBI_F_MORE = 4, KBI_F_REPLAY = 8, KBI_F_RATE = 16,
+       KBI_F_UNICODE = 32 };
+struct kbi_req {
+    uint32_t magic;
+    uint32_t flags;
+    int32_t  batch;
+    uint32_t len;
+    struct kbi_pace pace;
+};
+struct kbi_reply {
+    int32_t status;
+    struct kbi_stats stats;
+};
+
+// $KBINSERT_SOCKET, else $XDG_RUNTIME_DIR/kbinsert.sock, else /tmp/kbinsert-<uid>.sock
+static void socket_path(struct sockaddr_un *sa) {
+    const char *env = getenv("KBINSERT_SOCKET");
+    const char *rt = getenv("XDG_RUNTIME_DIR");
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (env && *env)
+        snprintf(sa->sun_path, sizeof(sa->sun_path), "%s", env);
+    else if (rt && *rt)
+        snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/kbinsert.sock", rt);
+    else
+        snprintf(sa->sun_path, sizeof(sa->sun_path), "/tmp/kbinsert-%u.sock", (unsigned)getuid());
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send the request header, attaching pass_fd (if >= 0) as ancillary data
+static int send_req(int fd, const struct kbi_req *req, int pass_fd) {
+    struct iovec iov = { (void *)req, sizeof(*req) };
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (pass_fd >= 0) {
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &pass_fd, sizeof(int));
+    }
+    return sendmsg(fd, &msg, 0) == (ssize_t)sizeof(*req) ? 0 : -1;
+}
+
+// Receive the request header and an optional passed fd (else *got_fd = -1)
+static int recv_req(int fd, struct kbi_req *req, int *got_fd) {
+    struct iovec iov = { req, sizeof(*req) };
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+    *got_fd = -1;
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(got_fd, CMSG_DATA(cm), sizeof(int));
+    if ((size_t)n < sizeof(*req))
+        return read_full(fd, (char *)req + n, sizeof(*req) - n);
+    return 0;
+}
+
+// Connect to a running daemon, or return -1 if none is listening
+static int client_connect(void) {
+    struct sockaddr_un sa;
+    socket_path(&sa);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Have the daemon replay a macro file
+static int client_replay(int fd, const char *path, const struct kbi_pace *pace, int rate_given,
+                         int tty_fd, struct kbi_stats *stats) {
+    char abs[PATH_MAX];
+    struct kbi_req req = { KBI_MAGIC, KBI_F_REPLAY | (rate_given ? KBI_F_RATE : 0), 0, 0, *pace };
+    struct kbi_reply reply = { .status = 1 };
+    if (!realpath(path, abs)) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    req.len = strlen(abs);
+    if (send_req(fd, &req, tty_fd) < 0 || write_full(fd, abs, req.len) < 0
+        || read_full(fd, &reply, sizeof(reply)) < 0) {
+        fprintf(stderr, "kbinsert: lost connection to daemon\n");
+        reply.status = 1;
+    }
+    close(fd);
+    *stats = reply.stats;
+    return reply.status;
+}
+
+/* Macros replayed by the daemon stay mapped, keyed by path and checked
+ * against the file's identity, so a repeat costs one stat()
+ */
+#define MACRO_CACHE 16
+
+struct macro_slot {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    long long used;
+    struct kbi_script s;
+};
+static struct macro_slot macro_cache[MACRO_CACHE];
+
+static const struct kbi_script *macro_get(const char *path) {
+    static long long tick;
+    struct macro_slot *slot = NULL;
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        perror(path);
+        return NULL;
+    }
+    for (int i = 0; i < MACRO_CACHE; i++) {
+        struct macro_slot *m = &macro_cache[i];
+        if (m->s.map && strcmp(m->path, path) == 0) {
+            if (m->dev == st.st_dev && m->ino == st.st_ino && m->size == st.st_size
+                && m->mtime.tv_sec == st.st_mtim.tv_sec && m->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                m->used = ++tick;
+                return &m->s;
+            }
+            slot = m;               // changed on disk: reload in place
+            break;
+        }
+        if (!slot || m->used < slot->used) slot = m;
+    }
+    kbi_script_free(&slot->s);
+    if (kbi_script_load(&slot->s, path) < 0) return NULL;
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->size = st.st_size;
+    slot->mtime = st.st_mtim;
+    slot->used = ++tick;
+    return &slot->s;
+}
+
+static volatile sig_atomic_t daemon_stop = 0;
+static void daemon_signal(int sig) { (void)sig; daemon_stop = 1; }
+
+// Handle one client connection: read request, inject, reply
+static void daemon_serve(struct kbi_ctx *ctx, int cfd) {
+    struct ucred cred;
+    socklen_t clen = sizeof(cred);
+    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) < 0
+        || (cred.uid != getuid() && cred.uid != 0)) {
+        fprintf(stderr, "kbinsertd: rejecting client (uid mismatch)\n");
+        return;
+    }
+    struct kbi_req req;
+    int tty_fd;
+    if (recv_req(cfd, &req, &tty_fd) < 0 || req.magic != KBI_MAGIC
+        || req.len > CHUNK || req.batch < 0 || req.pace.rate <= 0
+        || req.pace.burst < 1 || (unsigned)req.pace.mode > KBI_PACE_ADAPTIVE) {
+        fprintf(stderr, "kbinsertd: malformed request\n");
+        if (tty_fd >= 0) close(tty_fd);
+        return;
+    }
+    struct kbi_reply reply = { .status = 1 };
+    struct kbi_keys need;
+    /* Our device types into the same focus as any local kbinsert, so we
+     * take our turn too, but only once the request (or its first frame)
+     * is in and the device is ready: a slow client holds up nobody until
+     * it has something to type.
+     */
+    struct queue_turn turn = {0};
+    int queued = 0;
+    char *buf = malloc(CHUNK + 1);
+    if (buf && (req.flags & KBI_F_REPLAY)) {
+        const struct kbi_script *m = NULL;
+        if (req.len < PATH_MAX && read_full(cfd, buf, req.len) == 0) {
+            buf[req.len] = '\0';
+            m = macro_get(buf);
+        }
+        if (m) {
+            kbi_begin(ctx, 0, KBI_BATCH_CHAR, req.flags & KBI_F_RATE ? &req.pace : &m->pace, tty_fd);
+            if (ensure_device(ctx, &m->keys) == 0) {
+                queue_enter(&turn);
+                reply.status = kbi_play(ctx, m, &reply.stats) < 0;
+            }
+        }
+    } else if (buf) {
+        kbi_begin(ctx, (req.flags & KBI_F_ESCAPES ? KBI_ESCAPES : 0) | (req.flags & KBI_F_SWAP ? KBI_SWAP : 0)
+                       | (req.flags & KBI_F_UNICODE ? KBI_UNICODE_HEX : 0),
+                  req.batch, &req.pace, tty_fd);
+        reply.status = 0;
+        for (;;) {
+            if (read_full(cfd, buf, req.len) < 0) {
+                reply.status = 1;
+                break;
+            }
+            // Find the keys each frame needs before any of it is typed
+            int last = !(req.flags & KBI_F_MORE);
+            memset(&need, 0, sizeof(need));
+            kbi_scan(ctx, buf, req.len, last, &need);
+            if (ensure_device(ctx, &need) < 0) {
+                reply.status = 1;
+                break;
+            }
+            if (!queued) {
+                queue_enter(&turn);
+                queued = 1;
+            }
+            if (kbi_inject(ctx, buf, req.len) < 0) reply.status = 1;
+            if (last) break;
+            if (read_full(cfd, &req, sizeof(req)) < 0 || req.magic != KBI_MAGIC || req.len > CHUNK) {
+                fprintf(stderr, "kbinsertd: malformed request\n");
+                reply.status = 1;
+                break;
+            }
+        }
+        if (kbi_end(ctx, &reply.stats) < 0) reply.status = 1;
+    }
+    queue_leave(&turn);
+    free(buf);
+    if (tty_fd >= 0) close(tty_fd);
+    write_full(cfd, &reply, sizeof(reply));
+}
+
+static int run_daemon(struct kbi_ctx *ctx, int show_stats) {
+    struct sockaddr_un sa;
+    socket_path(&sa);
+
+    // Refuse to start twice; clear a stale socket left by a dead daemon
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) { perror("socket"); return 1; }
+    if (connect(lfd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+        fprintf(stderr, "kbinsertd: already running on %s\n", sa.sun_path);
+        close(lfd);
+        return 1;
+    }
+    unlink(sa.sun_path);
+
+    mode_t old_mask = umask(077);
+    int rc = bind(lfd, (struct sockaddr *)&sa, sizeof(sa));
+    umask(old_mask);
+    if (rc < 0 || listen(lfd, 16) < 0) {
+        perror(sa.sun_path);
+        close(lfd);
+        return 1;
+    }
+
+    // Start with every key used before, so most requests reuse the device
+    struct kbi_keys keys = { { 0 } };
+    if (profile_load(&keys) < 0) kbi_all_keys(ctx, &keys);
+    if (kbi_open(ctx, &keys) < 0) {
+        unlink(sa.sun_path);
+        close(lfd);
+        return 1;
+    }
+
+    struct kbi_prof prof;
+    struct sigaction act = {0};
+    act.sa_handler = daemon_signal;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "kbinsertd: listening on %s\n", sa.sun_path);
+
+    while (!daemon_stop) {
+        int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        if (show_stats) {
+            kbi_prof_start(&prof);
+            kbi_set_profile(ctx, &prof);
+        }
+        daemon_serve(ctx, cfd);
+        close(cfd);
+        if (show_stats) {
+            kbi_set_profile(ctx, NULL);
+            print_profile(&prof, show_stats);
+        }
+    }
+
+    unlink(sa.sun_path);
+    close(lfd);
+    kbi_close(ctx);
+    for (int i = 0; i < MACRO_CACHE; i++) kbi_script_free(&macro_cache[i].s);
+    return 0;
+}
+
+/* Backends (-B): the ways this binary gets text typed, behind one
+ * interface. A backend is opened, fed the raw text piece by piece (it
+ * decodes escapes itself, so pieces may split them), flushed once at the
+ * end and closed, which returns the exit status:
+ *
+ *   tiocsti  push the bytes into our terminal's input queue: no device,
+ *            nothing to wait for (needs dev.tty.legacy_tiocsti=1 or root)
+ *   daemon   a running kbinsertd's uinput device
+ *   x11      XTest on $DISPLAY (libX11 is loaded at run time; see x11.h)
+ *   uinput   a uinput device of our own, which takes a while to be ready
+ *   pty      a new shell or command on a pty of ours (-p, -c, --prefill)
+ *
+ * -B auto takes the first of these that works here, in that order (pty
+ * only on request); see pick_backend().
+ */
+enum { BK_TIOCSTI, BK_DAEMON, BK_X11, BK_UINPUT, BK_PTY, BK_COUNT, BK_AUTO = -1 };
+
+struct backend_opts {
+    int flags, batch, quiet;
+    const struct kbi_pace *pace;
+    int tty_fd;                         // adaptive pacing: the consumer's tty
+    const char *keymap, *pty_cmd;
+    int prefill, ready_timeout_ms, report_ready, engine, verify;
+    struct kbi_prof *prof;
+    struct source *src;                 // uinput: scanned up front for its keys
+};
+
+struct backend {
+    const char *name;
+    void *(*open)(const struct backend_opts *o);        // NULL: failed (quietly if o->quiet)
+    int (*inject)(void *st, const char *buf, size_t len);
+    int (*flush)(void *st);
+    int (*close)(void *st, struct kbi_stats *stats);
+};
+
+/* Pty backend (-p): run a shell or command on a pseudo-terminal we own,
+ * write the text into its input side in large writes, then hand our
+ * terminal over to it until it exits. No /dev/uinput, no root and no
+ * pacing: the child reads at its own speed and we keep draining its
+ * output meanwhile. With --prefill the text goes in once the child has
+ * printed its prompt and gone quiet, minus trailing newlines, so it sits
+ * on the command line waiting for Enter.
+ */
+#define PTY_QUIET_MS   50     // --prefill: output silence that means "prompt is up"
+#define PTY_PROMPT_MS  2000   // --prefill: stop waiting for a prompt after this
+
+struct pty_backend {
+    int mfd;
+    pid_t pid;
+    int interactive, in_open, ready, seen_output, gone;
+    int escapes, prefill;
+    struct termios saved;
+    long long start;
+    struct kbi_esc esc;
+    const char *p;          // bytes still to write to the master
+    size_t len;
+    char held[64];          // --prefill: newlines that may turn out to be trailing
+    int nheld;
+    char dec[CHUNK + 4];
+    char out[CHUNK + 4 + 64];
+    char obuf[4096], ibuf[4096];
+};
+
+// Queue the next raw piece of the text (final: the text ends here)
+static void pty_stage(struct pty_backend *pb, const char *piece, size_t n, int final) {
+    size_t len = n;
+    if (pb->escapes) {
+        len = kbi_decode_escapes(&pb->esc, piece, n, pb->dec, final);
+        piece = pb->dec;
+    }
+    if (!pb->prefill) {
+        pb->p = piece;
+        pb->len = len;
+        return;
+    }
+    size_t keep = len, o = 0;
+    while (keep > 0 && (piece[keep - 1] == '\n' || piece[keep - 1] == '\r')) keep--;
+    if (keep > 0) {
+        memcpy(pb->out, pb->held, pb->nheld);
+        o = pb->nheld;
+        pb->nheld = 0;
+    }
+    memcpy(pb->out + o, piece, keep);
+    o += keep;
+    for (size_t i = keep; i < len; i++) {
+        if (pb->nheld == (int)sizeof(pb->held)) {
+            pb->out[o++] = pb->held[0];
+            memmove(pb->held, pb->held + 1, --pb->nheld);
+        }
+        pb->held[pb->nheld++] = piece[i];
+    }
+    pb->p = pb->out;
+    pb->len = o;
+}
+
+static volatile sig_atomic_t pty_winch;
+static void pty_signal(int sig) {
+    (void)sig;
+    pty_winch = 1;
+}
+
+/* Shuttle bytes until what's staged is written (relay 0), or, with relay,
+ * keep passing our stdin to the child until it exits. The child's output
+ * is copied to ours throughout.
+ */
+static void pty_pump(struct pty_backend *pb, int relay) {
+    struct winsize ws;
+    while (!pb->gone) {
+        if (!relay && pb->ready && !pb->len) return;
+        if (pty_winch) {
+            pty_winch = 0;
+            if (ioctl(0, TIOCGWINSZ, &ws) == 0) ioctl(pb->mfd, TIOCSWINSZ, &ws);
+        }
+        // The payload goes first; our own stdin is relayed once it's all in
+        int relay_in = relay && pb->ready && !pb->len && pb->in_open;
+        struct pollfd fds[2] = {
+            { pb->mfd, POLLIN | (pb->len && pb->ready ? POLLOUT : 0), 0 },
+            { relay_in ? 0 : -1, POLLIN, 0 },
+        };
+        int rc = poll(fds, 2, pb->ready ? -1 : PTY_QUIET_MS);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            pb->gone = 1;
+            break;
+        }
+        if (rc == 0) {
+            pb->ready = pb->seen_output || now_ns() - pb->start > PTY_PROMPT_MS * 1000000LL;
+            continue;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(pb->mfd, pb->obuf, sizeof(pb->obuf));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n <= 0) {               // EIO: the child side is gone
+                pb->gone = 1;
+                break;
+            }
+            write_full(1, pb->obuf, n);
+            pb->seen_output = 1;
+        }
+        if (fds[0].revents & POLLOUT) {
+            ssize_t n = write(pb->mfd, pb->p, pb->len);
+            if (n > 0) {
+                pb->p += n;
+                pb->len -= n;
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(0, pb->ibuf, sizeof(pb->ibuf));
+            if (n > 0) {
+                pb->p = pb->ibuf;
+                pb->len = n;
+            } else if (n == 0 || errno != EINTR) {
+                // Piped stdin ran out: pass the EOF on to the child
+                pb->in_open = 0;
+                if (!pb->interactive) {
+                    pb->p = "\x04";
+                    pb->len = 1;
                 }
-                out[j++] = (char)v;
             }
-            else if (in[i] == '\\') {
-                out[j++] = '\\'; i++;
+        }
+    }
+}
+
+static void *pty_open(const struct backend_opts *o) {
+    struct pty_backend *pb = calloc(1, sizeof(*pb));
+    if (!pb) return NULL;
+    pb->mfd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (pb->mfd < 0 || grantpt(pb->mfd) < 0 || unlockpt(pb->mfd) < 0) {
+        perror("pty");
+        if (pb->mfd >= 0) close(pb->mfd);
+        free(pb);
+        return NULL;
+    }
+    const char *slave = ptsname(pb->mfd);
+    struct winsize ws;
+    pb->interactive = isatty(0);
+    if (pb->interactive) tcgetattr(0, &pb->saved);
+
+    pb->pid = fork();
+    if (pb->pid < 0) {
+        perror("fork");
+        close(pb->mfd);
+        free(pb);
+        return NULL;
+    }
+    if (pb->pid == 0) {
+        setsid();
+        int sfd = open(slave, O_RDWR);
+        if (sfd < 0) { perror(slave); _exit(127); }
+        ioctl(sfd, TIOCSCTTY, 0);
+        if (pb->interactive) {
+            tcsetattr(sfd, TCSANOW, &pb->saved);
+            if (ioctl(0, TIOCGWINSZ, &ws) == 0) ioctl(sfd, TIOCSWINSZ, &ws);
+        }
+        dup2(sfd, 0);
+        dup2(sfd, 1);
+        dup2(sfd, 2);
+        if (sfd > 2) close(sfd);
+        const char *shell = getenv("SHELL");
+        if (!shell || !*shell) shell = "/bin/sh";
+        if (o->pty_cmd) execl("/bin/sh", "sh", "-c", o->pty_cmd, (char *)NULL);
+        else execl(shell, shell, (char *)NULL);
+        perror(o->pty_cmd ? "/bin/sh" : shell);
+        _exit(127);
+    }
+
+    if (pb->interactive) {
+        struct termios raw = pb->saved;
+        cfmakeraw(&raw);
+        tcsetattr(0, TCSAFLUSH, &raw);
+        struct sigaction act = {0};
+        act.sa_handler = pty_signal;
+        sigaction(SIGWINCH, &act, NULL);
+    }
+    fcntl(pb->mfd, F_SETFL, O_NONBLOCK);
+    pb->in_open = 1;
+    pb->ready = !o->prefill;
+    pb->escapes = o->flags & KBI_ESCAPES;
+    pb->prefill = o->prefill;
+    pb->start = now_ns();
+    return pb;
+}
+
+// A child that exits before taking all the text isn't an error: its exit
+// status says how it went
+static int pty_inject(void *st, const char *buf, size_t len) {
+    struct pty_backend *pb = st;
+    pty_stage(pb, buf, len, 0);
+    pty_pump(pb, 0);
+    return 0;
+}
+
+static int pty_flush(void *st) {
+    struct pty_backend *pb = st;
+    pty_stage(pb, "", 0, 1);
+    pty_pump(pb, 0);
+    return 0;
+}
+
+// Stay attached until the child exits; its exit status is ours
+static int pty_close(void *st, struct kbi_stats *stats) {
+    struct pty_backend *pb = st;
+    (void)stats;
+    pty_pump(pb, 1);
+    if (pb->interactive) tcsetattr(0, TCSAFLUSH, &pb->saved);
+    close(pb->mfd);
+    int status = 0;
+    while (waitpid(pb->pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    free(pb);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Macros (--compile / --replay): the text rendered to key events once,
+ * with its pacing, and saved in a file that later runs map and write to
+ * the device as-is (see kbi_script_save())
+ */
+static int run_compile(const char *path, struct source *src, const char *keymap,
+                       int flags, int batch, const struct kbi_pace *pace, int show_stats) {
+    struct kbi_ctx *ctx = kbi_new();
+    struct kbi_script script;
+    struct kbi_stats st;
+    const char *piece;
+    ssize_t n;
+    int status = 0;
+    if (!ctx || (keymap && *keymap && kbi_set_keymap(ctx, keymap) < 0)) return 1;
+    kbi_begin(ctx, flags, batch, pace, -1);
+    kbi_record(ctx, &script);
+    while ((n = source_next(src, &piece)) > 0)
+        if (kbi_inject(ctx, piece, n) < 0) status = 1;
+    if (kbi_end(ctx, &st) < 0 || n < 0) status = 1;
+    if (!status && kbi_script_save(&script, path) < 0) status = 1;
+    if (!status && show_stats)
+        fprintf(stderr, "kbinsert: %s: %lld chars, %zu events in %zu writes, %s pacing\n",
+                path, st.chars, script.nev, script.nbatch, kbi_pace_name(script.pace.mode));
+    kbi_script_free(&script);
+    kbi_free(ctx);
+    return status;
+}
+
+static int run_replay(const char *path, const struct kbi_pace *pace, int rate_given, int local_only,
+                      int ready_timeout_ms, int report_ready, int engine, int show_stats) {
+    struct kbi_script script;
+    struct kbi_stats st;
+    struct kbi_prof prof;
+    int tty_fd = -1, status = 1, local = 0;
+    // The macro's own pacing may be adaptive too; the tty is unused otherwise
+    if (pace->mode == KBI_PACE_ADAPTIVE || !rate_given)
+        tty_fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+    int sfd = local_only ? -1 : client_connect();
+    if (sfd >= 0) {
+        status = client_replay(sfd, path, pace, rate_given, tty_fd, &st);
+    } else {
+        kbi_prof_start(&prof);
+        kbi_prof_phase(&prof, KBI_PH_INPUT);
+        local = kbi_script_load(&script, path) == 0;
+        kbi_prof_phase(&prof, KBI_PH_OTHER);
+    }
+    if (local) {
+        struct kbi_ctx *ctx = kbi_new();
+        if (ctx) {
+            kbi_set_ready(ctx, ready_timeout_ms, report_ready);
+            kbi_set_engine(ctx, engine);
+            if (show_stats) kbi_set_profile(ctx, &prof);
+            kbi_begin(ctx, 0, KBI_BATCH_CHAR, rate_given ? pace : &script.pace, tty_fd);
+            // Set the device up before queueing, so others type meanwhile
+            if (kbi_open(ctx, &script.keys) >= 0) {
+                struct queue_turn turn;
+                queue_enter(&turn);
+                status = kbi_play(ctx, &script, &st) < 0;
+                queue_leave(&turn);
             }
-            else {
-                out[j++] = in[i++];
+            kbi_free(ctx);
+        }
+        kbi_script_free(&script);
+    }
+    if (show_stats && status == 0) {
+        print_pace_stats(&st, show_stats);
+        if (local) print_profile(&prof, show_stats);
+    }
+    if (tty_fd >= 0) close(tty_fd);
+    return status;
+}
+
+/* TIOCSTI: bytes pushed into a terminal's input queue as if typed there,
+ * paced like a token bucket that starts full: byte i goes out once
+ * i + 1 - burst tokens have accrued. With room set, at most that many
+ * bytes are left waiting in the queue (FIONREAD; the tty must not be
+ * canonical, or only complete lines count): beyond what the line
+ * discipline holds it would drop them. A queue that nothing drains for
+ * TTY_STALL_MS is an error rather than a hang.
+ */
+#define TTY_STALL_MS 3000
+
+struct tty_out {
+    int fd;
+    const char *name;
+    double rate, burst;
+    int room, credit;           // queue limit (0: none); bytes we may push before asking again
+    long long t0, sent, slept_ns, stalls;
+};
+
+static void tty_out_init(struct tty_out *to, int fd, const char *name, const struct kbi_pace *pace, int room) {
+    memset(to, 0, sizeof(*to));
+    to->fd = fd;
+    to->name = name;
+    to->rate = pace->rate;
+    to->burst = pace->mode == KBI_PACE_BURST ? pace->burst : 1;
+    to->room = room;
+}
+
+static int tty_wait_room(struct tty_out *to) {
+    int inq = 0, last = -1;
+    long long since = 0, t = now_ns();
+    while (ioctl(to->fd, FIONREAD, &inq) == 0 && inq >= to->room) {
+        long long now = now_ns();
+        if (inq != last) {
+            if (last < 0) to->stalls++;
+            last = inq;
+            since = now;
+        } else if (now - since > TTY_STALL_MS * 1000000LL) {
+            fprintf(stderr, "kbinsert: %s: %d bytes stuck in the input queue; nothing is reading it\n",
+                    to->name, inq);
+            return -1;
+        }
+        usleep(1000);
+    }
+    to->slept_ns += now_ns() - t;
+    to->credit = to->room - inq;
+    return 0;
+}
+
+// The pacing clock starts with the first byte (not at open: we may have
+// waited for our turn since)
+static int tty_push(struct tty_out *to, const char *buf, size_t len) {
+    if (!to->t0) to->t0 = now_ns();
+    for (size_t i = 0; i < len; i++) {
+        double ahead = to->sent + 1 - to->burst;
+        if (ahead > 0) {
+            long long due = to->t0 + (long long)(ahead * 1e9 / to->rate), now = now_ns();
+            struct timespec ts = { due / 1000000000LL, due % 1000000000LL };
+            if (due > now) {
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                    ;
+                to->slept_ns += due - now;
             }
-        } else {
-            out[j++] = in[i++];
-        }
-    }
-    out[j] = '\0';
-    return out;
-}
-
-// Table mapping a-z to KEY_* codes
-static const int keycodes_alpha[26] = {
-    KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J,
-    KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T,
-    KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z
-};
-
-// Map a printable char to keycode and shift flag
-static int char_to_keycode(char c, int *shift) {
-    *shift = 0;
-    if (c >= 'a' && c <= 'z')       return keycodes_alpha[c - 'a'];
-    if (c >= 'A' && c <= 'Z') { *shift = 1; return keycodes_alpha[c - 'A']; }
-    if (c >= '1' && c <= '9')       return KEY_1 + (c - '1');
-    if (c == '0')                   return KEY_0;
-    if (c == ' ')                   return KEY_SPACE;
-    if (c == '\n' || c == '\r')   return KEY_ENTER;
-    switch (c) {
-        case '-':  return KEY_MINUS;
-        case '=':  return KEY_EQUAL;
-        case '[':  return KEY_LEFTBRACE;
-        case ']':  return KEY_RIGHTBRACE;
-        case '\\':return KEY_BACKSLASH;
-        case ';':  return KEY_SEMICOLON;
-        case '\'':return KEY_APOSTROPHE;
-        case ',':  return KEY_COMMA;
-        case '.':  return KEY_DOT;
-        case '/':  return KEY_SLASH;
-        case '`':  return KEY_GRAVE;
-        case '!':  *shift = 1; return KEY_1;
-        case '@':  *shift = 1; return KEY_2;
-        case '#':  *shift = 1; return KEY_3;
-        case '$':  *shift = 1; return KEY_4;
-        case '%':  *shift = 1; return KEY_5;
-        case '^':  *shift = 1; return KEY_6;
-        case '&':  *shift = 1; return KEY_7;
-        case '*':  *shift = 1; return KEY_8;
-        case '(':  *shift = 1; return KEY_9;
-        case ')':  *shift = 1; return KEY_0;
-        case '_':  *shift = 1; return KEY_MINUS;
-        case '+':  *shift = 1; return KEY_EQUAL;
-        case '{':  *shift = 1; return KEY_LEFTBRACE;
-        case '}':  *shift = 1; return KEY_RIGHTBRACE;
-        case '|':  *shift = 1; return KEY_BACKSLASH;
-        case ':':  *shift = 1; return KEY_SEMICOLON;
-        case '"': *shift = 1; return KEY_APOSTROPHE;
-        case '<':  *shift = 1; return KEY_COMMA;
-        case '>':  *shift = 1; return KEY_DOT;
-        case '?':  *shift = 1; return KEY_SLASH;
-        case '~':  *shift = 1; return KEY_GRAVE;
-    }
-    return -1;
-}
-
-// Initialize the uinput device and enable needed keys
-static int setup_uinput(void) {
-    ufd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if (ufd < 0) { perror("open /dev/uinput"); return -1; }
-
-    // Enable key events
-    if (ioctl(ufd, UI_SET_EVBIT, EV_KEY) < 0) return -1;
-
-    // Enable alphabetic
-    for (size_t i = 0; i < sizeof(keycodes_alpha)/sizeof(*keycodes_alpha); i++)
-        ioctl(ufd, UI_SET_KEYBIT, keycodes_alpha[i]);
-
-    // Enable digits
-    int digits[] = { KEY_1,KEY_2,KEY_3,KEY_4,KEY_5,KEY_6,KEY_7,KEY_8,KEY_9,KEY_0 };
-    for (size_t i = 0; i < sizeof(digits)/sizeof(*digits); i++)
-        ioctl(ufd, UI_SET_KEYBIT, digits[i]);
-
-    // Enable extras (including CapsLock)
-    int extras[] = { KEY_SPACE,KEY_ENTER,KEY_MINUS,KEY_EQUAL,
-                     KEY_LEFTBRACE,KEY_RIGHTBRACE,KEY_BACKSLASH,
-                     KEY_SEMICOLON,KEY_APOSTROPHE,KEY_COMMA,
-                     KEY_DOT,KEY_SLASH,KEY_GRAVE,
-                     KEY_LEFTSHIFT,KEY_LEFTCTRL,KEY_CAPSLOCK };
-    for (size_t i = 0; i < sizeof(extras)/sizeof(*extras); i++)
-        ioctl(ufd, UI_SET_KEYBIT, extras[i]);
-
-    // Create device
-    struct uinput_setup usetup = {0};
-    snprintf(usetup.name, UINPUT_MAX_NAME_SIZE, "kinject-uinput");
-    usetup.id.bustype = BUS_USB;
-    usetup.id.vendor  = 0x1234;
-    usetup.id.product = 0x5678;
-    ioctl(ufd, UI_DEV_SETUP, &usetup);
-    ioctl(ufd, UI_DEV_CREATE, NULL);
-    sleep(1);
+        }
+        if (to->room && to->credit <= 0 && tty_wait_room(to) < 0) return -1;
+        if (ioctl(to->fd, TIOCSTI, buf + i) < 0) {
+            fprintf(stderr, "kbinsert: %s: TIOCSTI: %s%s\n", to->name, strerror(errno),
+                    errno == EIO ? " (disabled by sysctl dev.tty.legacy_tiocsti?)" :
+                    errno == EPERM ? " (not our terminal; needs root)" : "");
+            return -1;
+        }
+        to->sent++;
+        to->credit--;
+    }
+    return 0;
+}
+
+/* Fan-out (-t): type the same text into many targets at once. A target is
+ * a terminal (/dev/pts/N, /dev/ttyN), typed into with TIOCSTI, or
+ * uinput[:NAME], a device of its own (NAME lets udev rules assign it to a
+ * seat). The text is decoded once for the terminals and rendered to events
+ * once for the devices (kbi_record()); the workers share both read-only
+ * and pace each target on its own, so a run takes as long as its slowest
+ * target instead of the sum of them all.
+ */
+#define FANOUT_MAX_JOBS 64
+
+struct fanout_target {
+    const char *spec;
+    int status;
+    long long chars, elapsed_ns;
+};
+
+struct fanout {
+    struct fanout_target *t;
+    int n, next;                        // next target to claim (atomic)
+    const char *text;                   // decoded, for terminals
+    size_t len;
+    const struct kbi_script *script;    // rendered, for devices
+    const struct kbi_pace *pace;
+    int ready_timeout_ms, report_ready, engine;
+};
+
+static int is_device_target(const char *spec) {
+    return strncmp(spec, "uinput", 6) == 0 && (spec[6] == '\0' || spec[6] == ':');
+}
+
+static int fanout_tty(const struct fanout *fo, struct fanout_target *t) {
+    struct tty_out to;
+    int fd = open(t->spec, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(t->spec);
+        return -1;
+    }
+    tty_out_init(&to, fd, t->spec, fo->pace, 0);
+    int ret = tty_push(&to, fo->text, fo->len);
+    t->chars = to.sent;
+    t->elapsed_ns = to.t0 ? now_ns() - to.t0 : 0;
+    close(fd);
+    return ret;
+}
+
+static int fanout_device(const struct fanout *fo, struct fanout_target *t) {
+    struct kbi_ctx *ctx = kbi_new();
+    struct kbi_stats st;
+    if (!ctx) return -1;
+    if (t->spec[6] == ':') kbi_set_name(ctx, t->spec + 7);
+    kbi_set_ready(ctx, fo->ready_timeout_ms, fo->report_ready);
+    if (fo->engine != KBI_ENGINE_SYNC) kbi_set_engine(ctx, fo->engine);
+    kbi_begin(ctx, 0, KBI_BATCH_CHAR, fo->pace, -1);
+    int ret = kbi_play(ctx, fo->script, &st);
+    t->chars = st.chars;
+    t->elapsed_ns = st.elapsed_ns;
+    kbi_free(ctx);
+    return ret;
+}
+
+static void *fanout_worker(void *arg) {
+    struct fanout *fo = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&fo->next, 1, __ATOMIC_RELAXED)) < fo->n) {
+        struct fanout_target *t = &fo->t[i];
+        t->status = is_device_target(t->spec) ? fanout_device(fo, t) : fanout_tty(fo, t);
+    }
+    return NULL;
+}
+
+static int run_fanout(const char **specs, int n, struct source *src, const char *keymap,
+                      int flags, int batch, const struct kbi_pace *pace, int jobs,
+                      int ready_timeout_ms, int report_ready, int engine, int show_stats) {
+    struct fanout fo = { .n = n, .pace = pace, .ready_timeout_ms = ready_timeout_ms,
+                         .report_ready = report_ready, .engine = engine };
+    struct kbi_script script = {0};
+    char *raw = NULL, *dec = NULL;
+    size_t len = 0, cap = 0;
+    int ndev = 0, failed = 0, status = 1;
+    pthread_t tid[FANOUT_MAX_JOBS];
+
+    fo.t = calloc(n, sizeof(*fo.t));
+    if (!fo.t) return 1;
+    for (int i = 0; i < n; i++) {
+        fo.t[i].spec = specs[i];
+        ndev += is_device_target(specs[i]);
+    }
+
+    // The whole text, so every worker can start from the beginning
+    const char *piece;
+    ssize_t got;
+    while ((got = source_next(src, &piece)) > 0) {
+        if (len + got > cap) {
+            cap = (len + got) * 2;
+            char *p = realloc(raw, cap);
+            if (!p) { perror("kbinsert"); goto out; }
+            raw = p;
+        }
+        memcpy(raw + len, piece, got);
+        len += got;
+    }
+    if (got < 0) goto out;
+
+    if (ndev < n) {
+        fo.text = raw;
+        fo.len = len;
+        if (flags & KBI_ESCAPES) {
+            struct kbi_esc esc = {0};
+            if (!(dec = malloc(len + 4))) goto out;
+            fo.len = kbi_decode_escapes(&esc, raw, len, dec, 1);
+            fo.text = dec;
+        }
+    }
+    if (ndev) {
+        struct kbi_ctx *ctx = kbi_new();
+        if (!ctx || (keymap && *keymap && kbi_set_keymap(ctx, keymap) < 0)) goto out;
+        kbi_begin(ctx, flags, batch, pace, -1);
+        kbi_record(ctx, &script);
+        int ret = kbi_inject(ctx, raw, len);
+        if (kbi_end(ctx, NULL) < 0 || ret < 0) { kbi_free(ctx); goto out; }
+        kbi_free(ctx);
+        fo.script = &script;
+    }
+
+    if (jobs > n) jobs = n;
+    if (jobs > FANOUT_MAX_JOBS) jobs = FANOUT_MAX_JOBS;
+    // Devices type into the focus, so take a turn for them as one payload;
+    // terminals each have their own input queue
+    struct queue_turn turn = {0};
+    if (ndev) queue_enter(&turn);
+    long long t0 = now_ns(), slowest = 0;
+    int started = 0;
+    for (; started < jobs; started++)
+        if (pthread_create(&tid[started], NULL, fanout_worker, &fo) != 0) break;
+    if (!started) fanout_worker(&fo);
+    for (int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+    long long wall = now_ns() - t0;
+    queue_leave(&turn);
+
+    for (int i = 0; i < n; i++) {
+        struct fanout_target *t = &fo.t[i];
+        if (t->status < 0) failed++;
+        if (t->elapsed_ns > slowest) slowest = t->elapsed_ns;
+        if (show_stats)
+            fprintf(stderr, "kbinsert: %s: %lld chars in %.3f s%s\n", t->spec, t->chars,
+                    t->elapsed_ns / 1e9, t->status < 0 ? " (failed)" : "");
+    }
+    if (show_stats || failed)
+        fprintf(stderr, "kbinsert: %d targets in %.3f s (slowest %.3f s, %d threads), %d failed\n",
+                n, wall / 1e9, slowest / 1e9, started ? started : 1, failed);
+    status = failed ? 1 : 0;
+out:
+    kbi_script_free(&script);
+    free(dec);
+    free(raw);
+    free(fo.t);
+    return status;
+}
+
+/* The tiocsti, daemon, uinput and x11 backends (pty is above) */
+
+#define TTY_ROOM 4000           // bytes left in our tty's queue (n_tty holds 4095)
+
+struct tiocsti_backend {
+    struct tty_out out;
+    struct termios saved;
+    int escapes;
+    struct kbi_esc esc;
+    int mode;
+    char dec[CHUNK + 4];
+};
+
+/* Into our own terminal, with echo off while we type (the shell echoes
+ * the text when it reads it; the tty echoing it now as well would show it
+ * twice) and non-canonical so the queue room check sees partial lines.
+ */
+static void *tiocsti_open(const struct backend_opts *o) {
+    int fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        if (!o->quiet) perror("/dev/tty");
+        return NULL;
+    }
+    struct tiocsti_backend *tb = calloc(1, sizeof(*tb));
+    if (!tb) {
+        close(fd);
+        return NULL;
+    }
+    tty_out_init(&tb->out, fd, "/dev/tty", o->pace, TTY_ROOM);
+    tb->escapes = o->flags & KBI_ESCAPES;
+    tb->mode = o->pace->mode == KBI_PACE_BURST ? KBI_PACE_BURST : KBI_PACE_FIXED;
+    if (tcgetattr(fd, &tb->saved) == 0) {
+        struct termios t = tb->saved;
+        t.c_lflag &= ~(ECHO | ICANON);
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &t);
+    }
+    return tb;
+}
+
+static int tiocsti_inject(void *st, const char *buf, size_t len) {
+    struct tiocsti_backend *tb = st;
+    if (tb->escapes) {
+        len = kbi_decode_escapes(&tb->esc, buf, len, tb->dec, 0);
+        buf = tb->dec;
+    }
+    return tty_push(&tb->out, buf, len);
+}
+
+static int tiocsti_flush(void *st) {
+    struct tiocsti_backend *tb = st;
+    if (!tb->escapes) return 0;
+    size_t len = kbi_decode_escapes(&tb->esc, "", 0, tb->dec, 1);
+    return tty_push(&tb->out, tb->dec, len);
+}
+
+static int tiocsti_close(void *st, struct kbi_stats *stats) {
+    struct tiocsti_backend *tb = st;
+    tcsetattr(tb->out.fd, TCSANOW, &tb->saved);
+    close(tb->out.fd);
+    memset(stats, 0, sizeof(*stats));
+    stats->mode = tb->mode;
+    stats->chars = tb->out.sent;
+    stats->elapsed_ns = tb->out.t0 ? now_ns() - tb->out.t0 : 0;
+    stats->slept_ns = tb->out.slept_ns;
+    stats->stalls = tb->out.stalls;
+    stats->syscalls = tb->out.sent;
+    free(tb);
+    return 0;
+}
+
+// The text goes to kbinsertd frame by frame; the last (empty) one ends it
+struct daemon_backend {
+    int fd, tty_fd, first, failed;
+    struct kbi_req req;
+};
+
+static void *daemon_open(const struct backend_opts *o) {
+    int fd = client_connect();
+    if (fd < 0) {
+        if (!o->quiet) fprintf(stderr, "kbinsert: no kbinsertd is listening\n");
+        return NULL;
+    }
+    struct daemon_backend *db = calloc(1, sizeof(*db));
+    if (!db) {
+        close(fd);
+        return NULL;
+    }
+    uint32_t flags = (o->flags & KBI_ESCAPES ? KBI_F_ESCAPES : 0) | (o->flags & KBI_SWAP ? KBI_F_SWAP : 0)
+                   | (o->flags & KBI_UNICODE_HEX ? KBI_F_UNICODE : 0);
+    db->req = (struct kbi_req){ KBI_MAGIC, flags, o->batch, 0, *o->pace };
+    db->fd = fd;
+    db->tty_fd = o->tty_fd;
+    db->first = 1;
+    return db;
+}
+
+static int daemon_frame(struct daemon_backend *db, const char *buf, size_t len, int more) {
+    if (db->failed) return -1;
+    db->req.flags = more ? db->req.flags | KBI_F_MORE : db->req.flags & ~KBI_F_MORE;
+    db->req.len = len;
+    if ((db->first ? send_req(db->fd, &db->req, db->tty_fd) : write_full(db->fd, &db->req, sizeof(db->req))) < 0
+        || write_full(db->fd, buf, len) < 0)
+        db->failed = 1;
+    db->first = 0;
+    return db->failed ? -1 : 0;
+}
+
+static int daemon_inject(void *st, const char *buf, size_t len) {
+    return daemon_frame(st, buf, len, 1);
+}
+
+static int daemon_flush(void *st) {
+    (void)st;
+    return 0;
+}
+
+static int daemon_close(void *st, struct kbi_stats *stats) {
+    struct daemon_backend *db = st;
+    struct kbi_reply reply = { .status = 1 };
+    if (daemon_frame(db, "", 0, 0) < 0 || read_full(db->fd, &reply, sizeof(reply)) < 0) {
+        fprintf(stderr, "kbinsert: lost connection to daemon\n");
+        reply.status = 1;
+    }
+    close(db->fd);
+    free(db);
+    *stats = reply.stats;
+    return reply.status;
+}
+
+// A device of our own, registering just the keys the text needs when it
+// can be read ahead (see source_keys())
+static void *uinput_open(const struct backend_opts *o) {
+    struct kbi_ctx *ctx = kbi_new();
+    if (!ctx) return NULL;
+    if (o->keymap && *o->keymap && kbi_set_keymap(ctx, o->keymap) < 0) {
+        kbi_free(ctx);
+        return NULL;
+    }
+    kbi_set_ready(ctx, o->ready_timeout_ms, o->report_ready);
+    kbi_set_engine(ctx, o->engine);
+    kbi_set_profile(ctx, o->prof);
+    kbi_set_verify(ctx, o->verify);
+    kbi_begin(ctx, o->flags, o->batch, o->pace, o->tty_fd);
+    struct kbi_keys keys;
+    if (source_keys(ctx, o->src, &keys) < 0) kbi_all_keys(ctx, &keys);
+    else profile_save(&keys);
+    if (kbi_open(ctx, &keys) < 0) {
+        kbi_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static int uinput_inject(void *st, const char *buf, size_t len) {
+    return kbi_inject(st, buf, len);
+}
+
+static int uinput_flush(void *st) {
+    (void)st;
+    return 0;                   // kbi_end() waits for the last keys
+}
+
+static int uinput_close(void *st, struct kbi_stats *stats) {
+    int ret = kbi_end(st, stats);
+    kbi_free(st);
+    return ret < 0 || stats->keys_delivered < stats->keys_sent;
+}
+
+// XTest paces on the server: each key is held back 1/rate s (whole ms)
+struct x11_backend {
+    struct x11 *x;
+    int escapes, mode;
+    struct kbi_esc esc;
+    long long chars, t0;
+    char dec[CHUNK + 4];
+};
+
+static void *x11_backend_open(const struct backend_opts *o) {
+    struct x11_backend *xb = calloc(1, sizeof(*xb));
+    if (!xb) return NULL;
+    unsigned delay_ms = o->pace->rate >= 1000 ? 0 : (unsigned)(1000 / o->pace->rate);
+    if (!(xb->x = x11_open(delay_ms))) {
+        free(xb);
+        return NULL;
+    }
+    xb->escapes = o->flags & KBI_ESCAPES;
+    xb->mode = KBI_PACE_FIXED;
+    xb->t0 = now_ns();
+    return xb;
+}
+
+static int x11_backend_inject(void *st, const char *buf, size_t len) {
+    struct x11_backend *xb = st;
+    if (xb->escapes) {
+        len = kbi_decode_escapes(&xb->esc, buf, len, xb->dec, 0);
+        buf = xb->dec;
+    }
+    xb->chars += x11_type(xb->x, buf, len);
+    return 0;
+}
+
+static int x11_backend_flush(void *st) {
+    struct x11_backend *xb = st;
+    if (xb->escapes) {
+        size_t len = kbi_decode_escapes(&xb->esc, "", 0, xb->dec, 1);
+        xb->chars += x11_type(xb->x, xb->dec, len);
+    }
     return 0;
 }
 
+static int x11_backend_close(void *st, struct kbi_stats *stats) {
+    struct x11_backend *xb = st;
+    x11_close(xb->x);           // returns once the server has played it all
+    memset(stats, 0, sizeof(*stats));
+    stats->mode = xb->mode;
+    stats->chars = xb->chars;
+    stats->elapsed_ns = now_ns() - xb->t0;
+    free(xb);
+    return 0;
+}
+
+static const struct backend backends[BK_COUNT] = {
+    [BK_TIOCSTI] = { "tiocsti", tiocsti_open, tiocsti_inject, tiocsti_flush, tiocsti_close },
+    [BK_DAEMON]  = { "daemon", daemon_open, daemon_inject, daemon_flush, daemon_close },
+    [BK_X11]     = { "x11", x11_backend_open, x11_backend_inject, x11_backend_flush, x11_backend_close },
+    [BK_UINPUT]  = { "uinput", uinput_open, uinput_inject, uinput_flush, uinput_close },
+    [BK_PTY]     = { "pty", pty_open, pty_inject, pty_flush, pty_close },
+};
+
+static int parse_backend(const char *name) {
+    if (strcmp(name, "auto") == 0) return BK_AUTO;
+    for (int b = 0; b < BK_COUNT; b++)
+        if (strcmp(name, backends[b].name) == 0) return b;
+    return -2;
+}
+
+/* Probing for -B auto. Nothing is typed and no device is created. Only
+ * the slow check (whether $DISPLAY takes XTest connections) is cached,
+ * per boot, user and display; the rest (a controlling tty, whether
+ * TIOCSTI is allowed, a daemon's socket, /dev/uinput access) is a
+ * syscall or two and checked every time, since a sysctl or our
+ * capabilities can change it at any moment.
+ */
+#define PROBE_MAGIC "KBIPROB1"
+
+struct probe_cache {
+    char boot_id[40];
+    uid_t uid;
+    char display[64];
+    signed char ok[BK_COUNT];           // 1 works, 0 doesn't, -1 not probed yet
+};
+
+static void probe_cache_load(struct probe_cache *pc) {
+    struct probe_cache saved;
+    const char *disp = getenv("DISPLAY");
+    memset(pc, 0, sizeof(*pc));
+    memset(pc->ok, -1, sizeof(pc->ok));
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, pc->boot_id, sizeof(pc->boot_id) - 1);
+        (void)n;
+        close(fd);
+    }
+    pc->uid = geteuid();
+    snprintf(pc->display, sizeof(pc->display), "%s", disp ? disp : "");
+    if (cache_fetch("backends", PROBE_MAGIC, &saved, sizeof(saved)) == 0
+        && memcmp(saved.boot_id, pc->boot_id, sizeof(pc->boot_id)) == 0
+        && saved.uid == pc->uid && strcmp(saved.display, pc->display) == 0)
+        memcpy(pc->ok, saved.ok, sizeof(pc->ok));
+}
+
+static int has_sys_admin(void) {
+    char line[256];
+    unsigned long long eff = 0;
+    FILE *f = fopen("/proc/self/status", "re");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "CapEff: %llx", &eff) == 1) break;
+    fclose(f);
+    return (eff >> 21) & 1;     // CAP_SYS_ADMIN
+}
+
+// Linux 6.2+ refuses TIOCSTI without dev.tty.legacy_tiocsti=1 or CAP_SYS_ADMIN
+static int tiocsti_allowed(void) {
+    int legacy = 1;
+    FILE *f = fopen("/proc/sys/dev/tty/legacy_tiocsti", "re");
+    if (f) {
+        if (fscanf(f, "%d", &legacy) != 1) legacy = 0;
+        fclose(f);
+    }
+    return legacy || has_sys_admin();
+}
+
+static int backend_usable(int b, struct probe_cache *pc, int *dirty) {
+    struct sockaddr_un sa;
+    struct stat st;
+    int fd;
+    switch (b) {
+    case BK_TIOCSTI:
+        if ((fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0) return 0;
+        close(fd);
+        return tiocsti_allowed();
+    case BK_DAEMON:
+        socket_path(&sa);
+        return stat(sa.sun_path, &st) == 0 && S_ISSOCK(st.st_mode);
+    case BK_X11:
+        if (!*pc->display) return 0;
+        if (pc->ok[b] < 0) {
+            pc->ok[b] = x11_probe() == 0;
+            *dirty = 1;
+        }
+        return pc->ok[b];
+    case BK_UINPUT:
+        return access("/dev/uinput", W_OK) == 0;
+    }
+    return 0;
+}
+
+/* Open the first backend that works, fastest first. uinput_only skips
+ * the ones that don't go through a device of our own; a backend whose
+ * cached verdict turns out wrong is forgotten and the next one tried.
+ */
+static int pick_backend(const struct backend_opts *o, int uinput_only, void **st) {
+    struct probe_cache pc;
+    struct backend_opts quiet = *o;
+    int dirty = 0, found = -1;
+    quiet.quiet = 1;
+    probe_cache_load(&pc);
+    for (int b = uinput_only ? BK_UINPUT : 0; b < BK_PTY && found < 0; b++) {
+        if (!backend_usable(b, &pc, &dirty)) continue;
+        // The last resort may as well explain why it failed
+        if ((*st = backends[b].open(b == BK_UINPUT ? o : &quiet))) found = b;
+        else if (pc.ok[b] > 0) {
+            pc.ok[b] = -1;
+            dirty = 1;
+        }
+    }
+    if (dirty) cache_store("backends", PROBE_MAGIC, &pc, sizeof(pc));
+    if (found < 0)
+        fprintf(stderr, "kbinsert: no way to type here: no terminal that takes TIOCSTI, no kbinsertd,\n"
+                        "  no usable $DISPLAY and /dev/uinput isn't writable (see -B, -p)\n");
+    return found;
+}
+
+/* Benchmark (--bench): types synthetic payloads into a fresh device and
+ * reads them back from its evdev node on a second thread, timing each key
+ * press from write() to arrival. The node is grabbed (EVIOCGRAB), so
+ * nothing reaches the console or the desktop.
+ */
+static const char *bench_mixes[][2] = {
+    { "lower", "the quick brown fox jumps over the lazy dog " },
+    { "prose", "The Quick Brown Fox, jumping over 12 lazy Dogs! " },
+    { "shell", "ls -la | grep \"$USER\" && echo $((1+2)) > /tmp/x; [ -n \"${A}\" ] || exit 1 " },
+};
+static const size_t bench_sizes[] = { 100, 1000, 10000 };
+
+struct bench_reader {
+    int fd;
+    long long *recv;
+    long n, cap, dropped;
+    volatile int stop;
+};
+
+// Collect press times until told to stop and the node has been quiet 100 ms
+static void *bench_read(void *arg) {
+    struct bench_reader *r = arg;
+    struct input_event ev[64];
+    struct pollfd pfd = { r->fd, POLLIN, 0 };
+    for (;;) {
+        int rc = poll(&pfd, 1, 100);
+        if (rc == 0 && r->stop) break;
+        if (rc <= 0) continue;
+        ssize_t n = read(r->fd, ev, sizeof(ev));
+        long long t = now_ns();
+        for (ssize_t i = 0; i < n / (ssize_t)sizeof(*ev); i++) {
+            if (ev[i].type == EV_KEY && ev[i].value == 1 && r->n < r->cap)
+                r->recv[r->n++] = t;
+            else if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED)
+                r->dropped++;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Flush hook: stamp every key press with the time it was written
+struct bench_sent {
+    long long *t;
+    long n, cap;
+};
+
+static void bench_stamp(void *arg, const struct input_event *ev, size_t n) {
+    struct bench_sent *b = arg;
+    long long t = now_ns();
+    for (size_t i = 0; i < n && b->n < b->cap; i++)
+        if (ev[i].type == EV_KEY && ev[i].value == 1)
+            b->t[b->n++] = t;
+}
+
+static int bench_run(struct kbi_ctx *ctx, const char *mix, const char *pattern, size_t size,
+                     const struct kbi_pace *spec, int batch) {
+    size_t plen = strlen(pattern);
+    char *text = malloc(size);
+    long cap = size * 8 + 16;
+    struct bench_sent sent = { malloc(cap * sizeof(long long)), 0, cap };
+    struct bench_reader r = { -1, malloc(cap * sizeof(long long)), 0, cap, 0, 0 };
+    struct kbi_stats st;
+    int ret = -1;
+    if (!text || !sent.t || !r.recv) goto out;
+    for (size_t i = 0; i < size; i++) text[i] = pattern[i % plen];
+
+    struct kbi_keys keys = { { 0 } };
+    kbi_begin(ctx, 0, batch, spec, -1);
+    kbi_scan(ctx, text, size, 1, &keys);
+    long long t0 = now_ns();
+    if (kbi_open(ctx, &keys) < 0) goto out;
+    double startup_ms = (now_ns() - t0) / 1e6;
+    const char *node = kbi_event_node(ctx);
+    if (!node[0]) {
+        fprintf(stderr, "kbinsert: can't find the device's event node to read back\n");
+        goto destroy;
+    }
+    if ((r.fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0
+        || ioctl(r.fd, EVIOCGRAB, 1) < 0) {
+        fprintf(stderr, "kbinsert: can't grab %s: %s\n", node, strerror(errno));
+        goto destroy;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, bench_read, &r) != 0) goto destroy;
+    kbi_set_flush_hook(ctx, bench_stamp, &sent);
+    kbi_inject(ctx, text, size);
+    kbi_end(ctx, &st);
+    kbi_set_flush_hook(ctx, NULL, NULL);
+    r.stop = 1;
+    pthread_join(tid, NULL);
+
+    long n = r.n < sent.n ? r.n : sent.n;
+    double secs = n ? (r.recv[n - 1] - sent.t[0]) / 1e9 : 0;
+    for (long i = 0; i < n; i++) r.recv[i] -= sent.t[i];
+    qsort(r.recv, n, sizeof(*r.recv), cmp_ll);
+    printf("%-6s %6zu %11.0f %9.1f %9.1f %9.2f %11.1f %6ld\n", mix, size,
+           secs > 0 ? size / secs : 0,
+           n ? r.recv[n / 2] / 1e3 : 0, n ? r.recv[n * 99 / 100] / 1e3 : 0,
+           (double)st.syscalls / size, startup_ms, sent.n - r.n + r.dropped);
+    ret = 0;
+
+destroy:
+    if (r.fd >= 0) {
+        ioctl(r.fd, EVIOCGRAB, 0);
+        close(r.fd);
+    }
+    kbi_close(ctx);
+out:
+    free(r.recv);
+    free(sent.t);
+    free(text);
+    return ret;
+}
+
+static int run_bench(struct kbi_ctx *ctx, const struct kbi_pace *spec, int batch) {
+    if (spec->mode == KBI_PACE_ADAPTIVE) {
+        fprintf(stderr, "kbinsert: --bench has no tty to adapt to; use fixed or burst\n");
+        return 1;
+    }
+    if (spec->rate >= 1e9) printf("unpaced, batch %d\n", batch);
+    else printf("rate %s:%.0f, batch %d\n", kbi_pace_name(spec->mode), spec->rate, batch);
+    printf("%-6s %6s %11s %9s %9s %9s %11s %6s\n", "mix", "chars", "chars/s",
+           "p50 us", "p99 us", "sys/char", "startup ms", "lost");
+    fflush(stdout);
+    for (size_t m = 0; m < sizeof(bench_mixes) / sizeof(*bench_mixes); m++)
+        for (size_t z = 0; z < sizeof(bench_sizes) / sizeof(*bench_sizes); z++) {
+            if (bench_run(ctx, bench_mixes[m][0], bench_mixes[m][1], bench_sizes[z], spec, batch) < 0)
+                return 1;
+            fflush(stdout);
+        }
+    return 0;
+}
+
+/* --rt and --cpu: keep the timing of keys when the box is busy. Under
+ * SCHED_FIFO a wakeup for the next key preempts everything that isn't
+ * real-time, and mlockall() keeps page faults out of the way; pinning
+ * keeps us on a CPU that has been set aside, if there is one. Threads
+ * started later (-t, --engine thread) inherit all three. Both are best
+ * effort: without CAP_SYS_NICE or an rtprio limit we say so and go on.
+ */
+static void set_realtime(int prio, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            fprintf(stderr, "kbinsert: --cpu %d: %s\n", cpu, strerror(errno));
+    }
+    if (prio <= 0) return;
+    struct sched_param sp = { .sched_priority = prio };
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+        fprintf(stderr, "kbinsert: --rt: SCHED_FIFO %d: %s (keys keep normal priority)\n", prio, strerror(errno));
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        fprintf(stderr, "kbinsert: --rt: mlockall: %s\n", strerror(errno));
+}
+
 int main(int argc, char *argv[]) {
-    int escape_mode = 0, swap_ctrl_caps = 0;
-    int arg0 = 1;
+    int escape_mode = 0, swap_ctrl_caps = 0, unicode_hex = 0;
+    int batch = KBI_BATCH_CHAR;
+    int ready_timeout_ms = 1000, report_ready = 0;
+    int daemon_mode = strcmp(basename(argv[0]), "kbinsertd") == 0;
+    int local_only = 0, bench = 0, queue_stats = STATS_OFF;
+    int show_stats = parse_stats(getenv("KBINSERT_STATS"));
+    struct kbi_prof prof, *pr = NULL;
+    kbi_prof_start(&prof);
+    int pty_mode = 0, prefill = 0;
+    int backend = BK_AUTO, uinput_only = 0, verify = 0;
+    int engine = KBI_ENGINE_SYNC;
+    int rt_prio = 0, cpu = -1;
+    const char *compile_to = NULL, *replay = NULL;
+    int rate_given = 0;
+    const char **targets = NULL;
+    int ntargets = 0, jobs = FANOUT_MAX_JOBS;
+    const char *pty_cmd = NULL;
+    const char *in_file = NULL;
+    const char *keymap = getenv("KBINSERT_KEYMAP");
+    struct kbi_pace pace_spec = { KBI_PACE_FIXED, 200, 1, 200 };
+    struct kbi_pace bench_spec = { KBI_PACE_BURST, 1e9, 1e9, 1e9 };   // unpaced
+    int arg0 = argc;
     // Parse flags
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--escapes") == 0) {
             escape_mode = 1;
         } else if (strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "--swap") == 0) {
-            swap_ctrl_caps = 1;
+            swap_ctrl_caps = uinput_only = 1;
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) && i + 1 < argc) {
+            const char *m = argv[++i];
+            if (strcmp(m, "char") == 0)      batch = KBI_BATCH_CHAR;
+            else if (strcmp(m, "word") == 0) batch = KBI_BATCH_WORD;
+            else if ((batch = atoi(m)) < 1) {
+                fprintf(stderr, "Invalid batch size: %s\n", m);
+                return 1;
+            }
+            uinput_only = 1;
+        } else if ((strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--unicode") == 0) && i + 1 < argc) {
+            const char *m = argv[++i];
+            if (strcmp(m, "drop") == 0)     unicode_hex = 0;
+            else if (strcmp(m, "hex") == 0) unicode_hex = uinput_only = 1;
+            else {
+                fprintf(stderr, "Invalid unicode mode: %s\n", m);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = 1;
+        } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--local") == 0) {
+            local_only = 1;
+        } else if (strcmp(argv[i], "-T") == 0 || strcmp(argv[i], "--time-ready") == 0) {
+            report_ready = uinput_only = 1;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = uinput_only = 1;
+        } else if (strcmp(argv[i], "--ready-timeout") == 0 && i + 1 < argc) {
+            ready_timeout_ms = atoi(argv[++i]);
+            uinput_only = 1;
+        } else if ((strcmp(argv[i], "-B") == 0 || strcmp(argv[i], "--backend") == 0) && i + 1 < argc) {
+            if ((backend = parse_backend(argv[++i])) < BK_AUTO) {
+                fprintf(stderr, "Invalid backend: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--rate") == 0) && i + 1 < argc) {
+            if (kbi_parse_pace(argv[++i], &pace_spec) < 0) {
+                fprintf(stderr, "Invalid rate: %s\n", argv[i]);
+                return 1;
+            }
+            bench_spec = pace_spec;
+            rate_given = 1;
+            if (pace_spec.mode == KBI_PACE_ADAPTIVE) uinput_only = 1;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stats") == 0) {
+            show_stats = STATS_TEXT;
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            show_stats = parse_stats(argv[i] + 8);
+        } else if (strcmp(argv[i], "--queue-stats") == 0) {
+            queue_stats = STATS_TEXT;
+        } else if (strncmp(argv[i], "--queue-stats=", 14) == 0) {
+            queue_stats = parse_stats(argv[i] + 14);
+        } else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) && i + 1 < argc) {
+            in_file = argv[++i];
+        } else if ((strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--keymap") == 0) && i + 1 < argc) {
+            keymap = argv[++i];
+            uinput_only = 1;
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pty") == 0) {
+            pty_mode = 1;
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--command") == 0) && i + 1 < argc) {
+            pty_cmd = argv[++i];
+            pty_mode = 1;
+        } else if (strcmp(argv[i], "--prefill") == 0) {
+            prefill = pty_mode = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--target") == 0) && i + 1 < argc) {
+            char *save, *spec;
+            for (spec = strtok_r(argv[++i], ",", &save); spec; spec = strtok_r(NULL, ",", &save)) {
+                const char **t = realloc(targets, (ntargets + 1) * sizeof(*targets));
+                if (!t) return 1;
+                targets = t;
+                targets[ntargets++] = spec;
+            }
+        } else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+            if ((jobs = atoi(argv[++i])) < 1) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            compile_to = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            const char *e = argv[++i];
+            if (strcmp(e, "sync") == 0)       engine = KBI_ENGINE_SYNC;
+            else if (strcmp(e, "uring") == 0) engine = KBI_ENGINE_URING;
+            else if (strcmp(e, "thread") == 0) engine = KBI_ENGINE_THREAD;
+            else {
+                fprintf(stderr, "Invalid engine: %s\n", e);
+                return 1;
+            }
+            uinput_only = 1;
+        } else if (strcmp(argv[i], "--rt") == 0 || strncmp(argv[i], "--rt=", 5) == 0) {
+            rt_prio = argv[i][4] ? atoi(argv[i] + 5) : 50;
+            if (rt_prio < sched_get_priority_min(SCHED_FIFO) || rt_prio > sched_get_priority_max(SCHED_FIFO)) {
+                fprintf(stderr, "Invalid priority: %s\n", argv[i] + 5);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            char *end;
+            cpu = strtol(argv[++i], &end, 10);
+            if (*end || cpu < 0 || cpu >= CPU_SETSIZE) {
+                fprintf(stderr, "Invalid CPU: %s\n", argv[i]);
+                return 1;
+            }
         } else {
             arg0 = i;
             break;
         }
     }
-    if (argc <= arg0) {
-        fprintf(stderr, "Usage: %s [-e|--escapes] [-x|--swap] <text> [...]\n", argv[0]);
+    if (queue_stats)
+        return queue_print_stats(queue_stats == STATS_JSON);
+    if (rt_prio || cpu >= 0) set_realtime(rt_prio, cpu);
+    if (daemon_mode || bench) {
+        struct kbi_ctx *ctx = kbi_new();
+        if (!ctx || (keymap && *keymap && kbi_set_keymap(ctx, keymap) < 0)) return 1;
+        kbi_set_ready(ctx, ready_timeout_ms, report_ready);
+        kbi_set_engine(ctx, engine);
+        if (daemon_mode) kbi_set_verify(ctx, verify);
+        int status = daemon_mode ? run_daemon(ctx, show_stats) : run_bench(ctx, &bench_spec, batch);
+        kbi_free(ctx);
+        return status;
+    }
+    if (replay) {
+        if (argc > arg0 || in_file) {
+            fprintf(stderr, "%s: --replay takes no text\n", argv[0]);
+            return 1;
+        }
+        return run_replay(replay, &pace_spec, rate_given, local_only, ready_timeout_ms,
+                          report_ready, engine, show_stats);
+    }
+    if (in_file && argc > arg0) {
+        fprintf(stderr, "%s: text arguments can't be combined with -f\n", argv[0]);
+        return 1;
+    }
+    if (argc <= arg0 && !in_file) {
+        fprintf(stderr, "Usage: %s [-B|--backend NAME] [-e|--escapes] [-x|--swap] [-b|--batch char|word|N] [-l|--local]\n"
+                        "          [-r|--rate SPEC] [-s|--stats[=json]] [-T|--time-ready] [--ready-timeout MS]\n"
+                        "          [-k|--keymap FILE] [-u|--unicode drop|hex] [-p|--pty] [-c|--command CMD] [--prefill]\n"
+                        "          [--compile FILE] [--engine sync|uring|thread] [--verify] [-t|--target T[,T...]]... [-j|--jobs N]\n"
+                        "          [--rt[=PRIO]] [--cpu N]\n"
+                        "          <text> [...] | -f|--file FILE|-\n"
+                        "       %s [-r SPEC] [-s] [-l] --replay FILE\n"
+                        "       %s -d|--daemon   (or run as kbinsertd)\n"
+                        "       %s --bench [-r SPEC] [-b MODE] [-k FILE] [--engine E]\n"
+                        "       %s --queue-stats[=json]\n"
+                        "  -B, --backend How to type: tiocsti (into this terminal's input queue),\n"
+                        "               daemon (a running kbinsertd), x11 (XTest on $DISPLAY), uinput\n"
+                        "               (a device of our own) or pty (see -p). auto (default) takes the\n"
+                        "               first that works here, in that order; -x, -k, -u hex, -b,\n"
+                        "               adaptive -r, -T, --ready-timeout, --engine and --verify mean\n"
+                        "               uinput. uinput used to be the only way: -B uinput types as\n"
+                        "               earlier versions did.\n"
+                        "  -b, --batch  Events per write(): one char (default), one word, or N chars.\n"
+                        "  -r, --rate   Pacing: N or fixed:N (chars/s, default 200), burst:N[:B]\n"
+                        "               (token bucket, bursts of B), adaptive[:START[:MAX]] (speed up\n"
+                        "               while the tty keeps up; default 200..5000).\n"
+                        "  -s, --stats  Print a pacing summary when done and, if we typed the text\n"
+                        "               ourselves, where the time went: phases, syscalls, write()\n"
+                        "               latencies. --stats=json prints JSON lines. Also $KBINSERT_STATS\n"
+                        "               (text or json); for kbinsertd, per request.\n"
+                        "  -f, --file   Type the contents of FILE (- for stdin), streamed in 64K chunks.\n"
+                        "  -k, --keymap Compiled XKB keymap of the target's layout ($KBINSERT_KEYMAP),\n"
+                        "               e.g. from `xkbcli compile-keymap --layout de`. Enables UTF-8,\n"
+                        "               AltGr and dead keys. A running kbinsertd uses its own.\n"
+                        "  -u, --unicode Characters the layout can't type: drop them (default) or\n"
+                        "               type Ctrl+Shift+U, the hex codepoint and Space, which GTK/IBus\n"
+                        "               input methods turn back into the character.\n"
+                        "  -l, --local  Don't use a running kbinsertd; create our own device (-B uinput).\n"
+                        "  -p, --pty    Instead of uinput, start $SHELL on a new pty, write the text\n"
+                        "               into it at full speed and stay attached until it exits.\n"
+                        "  -c, --command CMD  Like -p, but run `sh -c CMD`.\n"
+                        "  --prefill    Like -p, but wait for the prompt and drop trailing newlines,\n"
+                        "               leaving the text on the command line unsubmitted.\n"
+                        "  --compile FILE  Don't type the text: save the key events it would produce\n"
+                        "               (after -e, -x, -k and -b), with its pacing, to macro FILE.\n"
+                        "  --replay FILE  Type a macro saved with --compile, at its own pace unless\n"
+                        "               -r is given. A running kbinsertd keeps macros mapped.\n"
+                        "  -t, --target Type the text into each target T in parallel instead: a terminal\n"
+                        "               (/dev/pts/N, via TIOCSTI; needs root on recent kernels) or\n"
+                        "               uinput[:NAME], a device of its own named NAME. Repeatable.\n"
+                        "  -j, --jobs   Worker threads for -t (default one per target, up to 64).\n"
+                        "  --engine     How events are written: sync (write() + nanosleep(), default),\n"
+                        "               uring (io_uring with kernel-side pacing timers; falls back\n"
+                        "               to sync if unavailable) or thread (a second thread paces and\n"
+                        "               writes while this one decodes). Also for -d and --bench.\n"
+                        "  --verify     Read every key back from the device's event node, report how\n"
+                        "               many were delivered and fail if any were dropped (writes that\n"
+                        "               overflow the node's buffer get split). Also for -d.\n"
+                        "  --rt[=PRIO]  Type at real-time priority (SCHED_FIFO, default 50) with memory\n"
+                        "               locked, so keys keep their timing on a loaded machine. Needs\n"
+                        "               CAP_SYS_NICE or an rtprio limit; -s reports the jitter.\n"
+                        "  --cpu N      Run on CPU N only (best with one kept free, e.g. isolcpus).\n"
+                        "  -T, --time-ready  Report how long the new device took to become usable.\n"
+                        "  --ready-timeout MS  Give up waiting for the device after MS (default 1000).\n"
+                        "  -d, --daemon Keep a uinput device open and serve requests on\n"
+                        "               $KBINSERT_SOCKET or $XDG_RUNTIME_DIR/kbinsert.sock.\n"
+                        "  --bench      Type synthetic text into a grabbed device and read it back:\n"
+                        "               chars/s, per-key latency, syscalls/char, startup time.\n"
+                        "               Unpaced unless -r is given.\n"
+                        "  --queue-stats  How often concurrent runs (and kbinsertd) had to wait their\n"
+                        "               turn to type, for how long, and who is typing now.\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    // Build raw string
-    size_t total = 0;
-    for (int i = arg0; i < argc; i++) total += strlen(argv[i]) + 1;
-    char *raw = malloc(total + 1);
-    raw[0] = '\0';
-    for (int i = arg0; i < argc; i++) {
-        strcat(raw, argv[i]);
-        if (i + 1 < argc) strcat(raw, " ");
+    int text_flags = (escape_mode ? KBI_ESCAPES : 0) | (swap_ctrl_caps ? KBI_SWAP : 0)
+                   | (unicode_hex ? KBI_UNICODE_HEX : 0);
+
+    // Raw input: the arguments joined with single spaces, or a stream
+    if (show_stats) pr = &prof;
+    kbi_prof_phase(pr, KBI_PH_INPUT);
+    struct source *src = malloc(sizeof(*src));
+    char *raw = NULL;
+    if (!src) return 1;
+    src->fd = -1;
+    if (in_file) {
+        src->fd = strcmp(in_file, "-") == 0 ? 0 : open(in_file, O_RDONLY | O_CLOEXEC);
+        if (src->fd < 0) { perror(in_file); return 1; }
+    } else {
+        size_t total = 0, off = 0;
+        for (int i = arg0; i < argc; i++) total += strlen(argv[i]) + 1;
+        raw = malloc(total);
+        if (!raw) return 1;
+        for (int i = arg0; i < argc; i++) {
+            size_t n = strlen(argv[i]);
+            memcpy(raw + off, argv[i], n);
+            off += n;
+            if (i + 1 < argc) raw[off++] = ' ';
+        }
+        src->buf = raw;
+        src->len = off;
+        src->off = 0;
     }
 
-    // Process escapes if requested
-    char *text = raw;
-    if (escape_mode) {
-        text = process_escapes(raw);
+    kbi_prof_phase(pr, KBI_PH_OTHER);
+
+    if (compile_to) {
+        int status = run_compile(compile_to, src, keymap, text_flags, batch, &pace_spec, show_stats);
+        if (src->fd > 0) close(src->fd);
+        free(src);
         free(raw);
-        if (!text) return 1;
-    }
-
-    if (setup_uinput() < 0) return 1;
-
-    // Inject
-    for (char *p = text; *p; p++) {
-        unsigned char c = *p;
-        int shift = 0;
-        int code = char_to_keycode(c, &shift);
-        if (code >= 0) {
-            if (shift) { emit(EV_KEY, KEY_LEFTSHIFT, 1); emit(EV_SYN, SYN_REPORT, 0); }
-            emit(EV_KEY, code, 1); emit(EV_SYN, SYN_REPORT, 0);
-            emit(EV_KEY, code, 0); emit(EV_SYN, SYN_REPORT, 0);
-            if (shift) { emit(EV_KEY, KEY_LEFTSHIFT, 0); emit(EV_SYN, SYN_REPORT, 0); }
-        } else if (c >= 1 && c <= 26) {
-            // Control char → ctrl+letter
-            int letter = keycodes_alpha[c - 1];
-            int ctrl_key = swap_ctrl_caps ? KEY_CAPSLOCK : KEY_LEFTCTRL;
-            emit(EV_KEY, ctrl_key, 1); emit(EV_SYN, SYN_REPORT, 0);
-            emit(EV_KEY, letter, 1);   emit(EV_SYN, SYN_REPORT, 0);
-            emit(EV_KEY, letter, 0);   emit(EV_SYN, SYN_REPORT, 0);
-            emit(EV_KEY, ctrl_key, 0); emit(EV_SYN, SYN_REPORT, 0);
-        }
-        usleep(5000);
-    }
-
-    // Destroy
-    ioctl(ufd, UI_DEV_DESTROY);
-    close(ufd);
-    if (escape_mode) free(text);
-    return 0;
+        return status;
+    }
+
+    if (ntargets) {
+        int status = run_fanout(targets, ntargets, src, keymap, text_flags, batch, &pace_spec,
+                                jobs, ready_timeout_ms, report_ready, engine, show_stats);
+        if (src->fd > 0) close(src->fd);
+        free(targets);
+        free(src);
+        free(raw);
+        return status;
+    }
+
+    // Adaptive pacing watches our controlling tty's input queue
+    int tty_fd = -1;
+    if (pace_spec.mode == KBI_PACE_ADAPTIVE)
+        tty_fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    struct kbi_stats stats;
+    struct backend_opts bo = {
+        .flags = text_flags, .batch = batch, .pace = &pace_spec, .tty_fd = tty_fd,
+        .keymap = keymap, .pty_cmd = pty_cmd, .prefill = prefill,
+        .ready_timeout_ms = ready_timeout_ms, .report_ready = report_ready, .engine = engine,
+        .verify = verify, .prof = pr, .src = src,
+    };
+    if (backend == BK_AUTO && pty_mode) backend = BK_PTY;
+    if (backend == BK_AUTO && local_only) backend = BK_UINPUT;
+
+    void *st = NULL;
+    long long t0 = now_ns();
+    if (backend == BK_AUTO) backend = pick_backend(&bo, uinput_only, &st);
+    else st = backends[backend].open(&bo);
+    long long open_ns = now_ns() - t0;
+    if (!st) return 1;
+    const struct backend *be = &backends[backend];
+
+    /* One payload at a time, in arrival order, once we're ready to type
+     * (a new device is set up while others type). The daemon takes its
+     * own turns; a pty, like our terminal's input queue, is ours alone.
+     */
+    struct queue_turn turn = {0};
+    if (backend != BK_DAEMON && backend != BK_PTY && backend != BK_TIOCSTI) queue_enter(&turn);
+
+    const char *piece;
+    ssize_t n;
+    int status = 0;
+    for (;;) {
+        kbi_prof_phase(pr, KBI_PH_INPUT);
+        n = source_next(src, &piece);
+        kbi_prof_phase(pr, KBI_PH_OTHER);
+        if (n <= 0) break;
+        if (be->inject(st, piece, n) < 0) {
+            status = 1;
+            break;
+        }
+    }
+    if ((status == 0 && be->flush(st) < 0) || n < 0) status = 1;
+    int rc = be->close(st, &stats);     // pty: the child's exit status
+    if (rc) status = rc;
+    queue_leave(&turn);
+    if (show_stats && backend != BK_PTY) {
+        if (show_stats == STATS_JSON)
+            fprintf(stderr, "{\"kbinsert\":\"backend\",\"name\":\"%s\",\"open_ns\":%lld,"
+                    "\"queue_wait_ns\":%lld,\"queue_ahead\":%u}\n", be->name, open_ns, turn.wait_ns, turn.ahead);
+        else
+            fprintf(stderr, "kbinsert: %s backend, ready in %.3f s, waited %.3f s behind %u payload%s\n",
+                    be->name, open_ns / 1e9, turn.wait_ns / 1e9, turn.ahead, turn.ahead == 1 ? "" : "s");
+        print_pace_stats(&stats, show_stats);
+        if (backend == BK_UINPUT) print_profile(pr, show_stats);
+    } else if (verify) {
+        print_verify(&stats, STATS_TEXT);
+    }
+
+    if (tty_fd >= 0) close(tty_fd);
+    if (src->fd > 0) close(src->fd);
+    free(src);
+    free(raw);
+    return status;
 }
@@ -0,0 +1,209 @@
+/* kbinsert.h — libkbinsert: type text through a virtual uinput keyboard
+ *
+ * A struct kbi_ctx holds everything an injection needs: the uinput device,
+ * the key table (US QWERTY, or an XKB layout), escape/UTF-8 decoder state,
+ * held modifiers, pacing and the event batch buffer. kbi_new() is the only
+ * allocation; kbi_inject() streams text through the context without
+ * allocating, so a long-running caller can type any number of snippets on
+ * one device:
+ *
+ *     struct kbi_ctx *ctx = kbi_new();
+ *     kbi_begin(ctx, 0, KBI_BATCH_CHAR, NULL, -1);
+ *     kbi_inject(ctx, "ls -l\n", 6);        // opens the device on first use
+ *     kbi_end(ctx, NULL);
+ *     ...
+ *     kbi_free(ctx);
+ *
+ * Errors are reported on stderr and returned as -1. A context must only
+ * be used by one thread at a time.
+ */
+#ifndef KBINSERT_H
+#define KBINSERT_H
+
+#include <stddef.h>
+#include <linux/input.h>
+
+/* kbi_begin() flags. Characters the layout can't type are dropped, or
+ * with KBI_UNICODE_HEX typed as Ctrl+Shift+U, hex codepoint, Space, which
+ * GTK, Qt and IBus input methods turn into the character (a console or
+ * plain X11 client just sees the keys).
+ */
+enum { KBI_ESCAPES = 1, KBI_SWAP = 2, KBI_UNICODE_HEX = 4 };
+
+// Batch granularity: flush per character, per word, or every N characters
+enum { KBI_BATCH_WORD = 0, KBI_BATCH_CHAR = 1 };
+
+/* Pacing: how long to wait before each flushed batch.
+ *   fixed:N            N chars/s, one char at a time (default 200, i.e. 5 ms)
+ *   burst:N[:B]        token bucket: N chars/s sustained, bursts of up to B
+ *   adaptive[:S[:M]]   start at S chars/s and speed up towards M while the
+ *                      consumer keeps up; slow down when it falls behind
+ */
+enum { KBI_PACE_FIXED, KBI_PACE_BURST, KBI_PACE_ADAPTIVE };
+
+struct kbi_pace {
+    int mode;
+    double rate;        // chars/s (starting rate for adaptive)
+    double burst;       // token bucket depth
+    double max_rate;    // adaptive ceiling
+};
+
+struct kbi_stats {
+    long long chars, elapsed_ns, slept_ns, stalls, drops;
+    double start_rate, end_rate, min_rate;
+    int mode, blind;
+    long long syscalls;     // writes and sleeps while typing
+    long long retries;      // writes retried after EAGAIN
+    long long keys_sent, keys_delivered;    // key events written / read back (kbi_set_verify)
+    /* Jitter, with fixed pacing only: intervals between paced writes, and
+     * how far they were off n / rate for n characters, either way. The
+     * io_uring engine only times its writes with a profile set.
+     */
+    long long intervals, jitter_p50_ns, jitter_p99_ns, jitter_p999_ns, jitter_max_ns;
+};
+
+// Set of key codes; a device registers only the keys it is given
+struct kbi_keys { unsigned long bits[KEY_CNT / (8 * sizeof(long)) + 1]; };
+
+// Incremental escape decoder state (\\, \n, \r, \xhh, \ooo, \^C)
+struct kbi_esc {
+    int state;
+    int val, cnt;       // partial \x / \ooo value and digit count
+    char hex1;          // first hex digit, re-emitted if the second isn't one
+};
+
+struct kbi_ctx;
+
+struct kbi_ctx *kbi_new(void);
+void kbi_free(struct kbi_ctx *ctx);                 // also destroys the device
+
+// Use the layout of a compiled XKB keymap instead of US QWERTY
+int kbi_set_keymap(struct kbi_ctx *ctx, const char *path);
+// Bound the wait for a new device to become usable; report prints timings
+void kbi_set_ready(struct kbi_ctx *ctx, int timeout_ms, int report);
+/* Engine: write() and nanosleep() per batch, or io_uring, which queues
+ * many batches with linked timeouts for pacing (one syscall per up to
+ * 128 batches) and lets kbi_inject() return while they are sent, or a
+ * thread: kbi_inject() decodes and maps into a bounded ring (8192 events)
+ * and an emitter thread owned by the context paces and writes them, so
+ * decoding never waits for pacing until the ring is full. Adaptive
+ * pacing always uses write(). KBI_ENGINE_URING fails with a message if
+ * io_uring is unavailable (Linux < 5.16, or disabled), leaving write().
+ */
+enum { KBI_ENGINE_SYNC, KBI_ENGINE_URING, KBI_ENGINE_THREAD };
+int kbi_set_engine(struct kbi_ctx *ctx, int engine);
+/* Delivery check: read the device's evdev node back (without grabbing it,
+ * so the keys still reach the focus) after every write and count the key
+ * events the input core delivered (keys_sent/keys_delivered in the
+ * stats). A write that overflows the node's event buffer loses keys for
+ * every reader; once that is seen, later writes are split small enough to
+ * fit. Uses write(), not io_uring. Typing fails if the node can't be
+ * read.
+ */
+void kbi_set_verify(struct kbi_ctx *ctx, int on);
+// Name of the uinput device (default "kinject-uinput"), e.g. for udev
+// rules that assign it to a seat; takes effect when it is next created
+void kbi_set_name(struct kbi_ctx *ctx, const char *name);
+/* Instrumentation: where the time goes. With a profile set, the context
+ * charges its time to phases (exclusive: time in a write during mapping
+ * counts as write), counts syscalls and bytes, and keeps a histogram of
+ * write() latencies: hist[i] counts writes that took [2^i, 2^(i+1)) ns.
+ * Callers charge their own work with kbi_prof_phase() (e.g. reading the
+ * text: KBI_PH_INPUT); everything else is KBI_PH_OTHER. The thread
+ * engine's emitter adds its syscalls and write latencies when the caller
+ * waits for it; phases are the caller's (time waiting for the emitter is
+ * sleep). Off by default, when the cost is a pointer test.
+ */
+enum { KBI_PH_OTHER, KBI_PH_INPUT, KBI_PH_SCAN, KBI_PH_SETUP, KBI_PH_READY,
+       KBI_PH_DECODE, KBI_PH_MAP, KBI_PH_WRITE, KBI_PH_SLEEP, KBI_PH_COUNT };
+enum { KBI_SYS_WRITE, KBI_SYS_IOCTL, KBI_SYS_SLEEP, KBI_SYS_URING, KBI_SYS_COUNT };
+#define KBI_HIST 40
+
+struct kbi_prof {
+    long long phase_ns[KBI_PH_COUNT];
+    long long calls[KBI_SYS_COUNT];
+    long long bytes;                    // written to the device
+    long long hist[KBI_HIST];
+    int cur;                            // running phase, since mark
+    long long mark;
+};
+// Reset prof and start charging KBI_PH_OTHER
+void kbi_prof_start(struct kbi_prof *prof);
+// Switch to phase and return the one that was running (to switch back)
+int kbi_prof_phase(struct kbi_prof *prof, int phase);
+const char *kbi_phase_name(int phase);
+void kbi_set_profile(struct kbi_ctx *ctx, struct kbi_prof *prof);     // NULL: off
+
+// Called with each batch of events just before it is written (with
+// io_uring: when it is queued; with the thread engine: on the emitter)
+void kbi_set_flush_hook(struct kbi_ctx *ctx,
+                        void (*fn)(void *arg, const struct input_event *ev, size_t n), void *arg);
+
+/* Make sure the device has at least keys (NULL: every key the layout can
+ * type). Returns 0 if the open device already covers them, 1 if it was
+ * (re)created, with the union of its old keys and these, or -1. Between
+ * kbi_inject()s the text goes on on the new device: held modifiers are
+ * pressed again and kbi_set_verify() reads back from its node.
+ */
+int kbi_open(struct kbi_ctx *ctx, const struct kbi_keys *keys);
+void kbi_close(struct kbi_ctx *ctx);
+const char *kbi_event_node(const struct kbi_ctx *ctx);    // "" if unknown
+const struct kbi_keys *kbi_device_keys(const struct kbi_ctx *ctx);
+
+/* Start a text: flags, batch size, pacing (NULL: fixed 200 chars/s) and,
+ * for adaptive pacing, the consumer's tty. The pacing clock starts with
+ * the first kbi_inject().
+ */
+void kbi_begin(struct kbi_ctx *ctx, int flags, int batch, const struct kbi_pace *pace, int tty_fd);
+// Type the next piece of the text; pieces may split escapes and UTF-8
+int kbi_inject(struct kbi_ctx *ctx, const char *buf, size_t len);
+// Finish the text: flush partial escapes, release modifiers, wait for
+// adaptive read-back, and fill in stats (may be NULL)
+int kbi_end(struct kbi_ctx *ctx, struct kbi_stats *stats);
+
+/* A text rendered to events once and played on any number of devices:
+ * kbi_begin(), kbi_record(), kbi_inject()..., kbi_end() fills the script
+ * instead of typing; kbi_play() then types it with its context's device
+ * and pacing. Playing only reads the script, so contexts in several
+ * threads may share one.
+ */
+// One paced write (chars 0: no wait); tty: the bytes it should put in the
+// consumer's tty queue, for adaptive pacing
+struct kbi_batch { unsigned chars, events, tty; };
+struct kbi_script {
+    struct input_event *ev;
+    struct kbi_batch *batch;
+    size_t nev, nbatch, ev_cap, batch_cap;
+    struct kbi_keys keys;                       // every key it presses
+    struct kbi_pace pace;                       // pacing it was recorded with
+    void *map;                                  // kbi_script_load(): the mapped file
+    size_t map_len;
+};
+void kbi_record(struct kbi_ctx *ctx, struct kbi_script *s);
+int kbi_play(struct kbi_ctx *ctx, const struct kbi_script *s, struct kbi_stats *stats);
+void kbi_script_free(struct kbi_script *s);
+/* Macro files: a script saved as-is, so loading it is one mmap() and
+ * playing it writes straight from the mapping. Loading checks that the
+ * file is complete, from this ABI, and only presses keys it declares.
+ */
+int kbi_script_save(const struct kbi_script *s, const char *path);
+int kbi_script_load(struct kbi_script *s, const char *path);
+
+/* OR into keys the keys the next piece of text would press, decoding it
+ * with the current kbi_begin() flags; final ends the text. Runs a decoder
+ * of its own, so it can be kept a piece ahead of kbi_inject().
+ */
+void kbi_scan(struct kbi_ctx *ctx, const char *buf, size_t len, int final, struct kbi_keys *keys);
+void kbi_all_keys(const struct kbi_ctx *ctx, struct kbi_keys *keys);
+
+void kbi_keys_add(struct kbi_keys *ks, int code);
+int  kbi_keys_has(const struct kbi_keys *ks, int code);
+int  kbi_keys_covers(const struct kbi_keys *have, const struct kbi_keys *need);
+void kbi_keys_union(struct kbi_keys *ks, const struct kbi_keys *other);
+
+int kbi_parse_pace(const char *arg, struct kbi_pace *pace);
+const char *kbi_pace_name(int mode);
+// out must have room for len + 4 bytes; final flushes a partial escape
+size_t kbi_decode_escapes(struct kbi_esc *st, const char *in, size_t len, char *out, int final);
+
+#endif
@@ -0,0 +1,634 @@
+/* layout.c — compile XKB keymaps into kbinsert layout tables
+ *
+ * Only what kbinsert needs is parsed: the xkb_keycodes section (key name →
+ * keycode) and group 1 of the xkb_symbols section. Levels 1-4 are assumed
+ * to be plain, Shift, AltGr and Shift+AltGr, which holds for the standard
+ * key types; keypad keys are skipped. Keysyms are resolved by name for
+ * ASCII, Latin-1 and a few common extras, or given as Uxxxx / 0x1xxxxxx.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/input-event-codes.h>
+#include "layout.h"
+
+#define CACHE_MAGIC   "KBILAY1"
+#define CACHE_VERSION 1
+
+struct cache_hdr {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t src_size;
+    int64_t  src_mtime_ns;
+    uint64_t src_ino;
+    uint16_t altgr_code;
+    uint16_t pad[3];
+};
+
+/* Keysym names */
+
+// Dead keys live above the Unicode range
+#define DEAD_BASE 0x200000
+enum { DEAD_GRAVE, DEAD_ACUTE, DEAD_CIRCUMFLEX, DEAD_TILDE, DEAD_DIAERESIS,
+       DEAD_ABOVERING, DEAD_CEDILLA, NUM_DEAD };
+#define LEVEL3_SHIFT (DEAD_BASE + 0x100)
+
+struct keysym_name { const char *name; uint32_t cp; };
+static const struct keysym_name keysym_names[] = {
+    { "space", 0x20 }, { "exclam", 0x21 }, { "quotedbl", 0x22 }, { "numbersign", 0x23 },
+    { "dollar", 0x24 }, { "percent", 0x25 }, { "ampersand", 0x26 }, { "apostrophe", 0x27 },
+    { "quoteright", 0x27 }, { "parenleft", 0x28 }, { "parenright", 0x29 }, { "asterisk", 0x2a },
+    { "plus", 0x2b }, { "comma", 0x2c }, { "minus", 0x2d }, { "period", 0x2e },
+    { "slash", 0x2f }, { "colon", 0x3a }, { "semicolon", 0x3b }, { "less", 0x3c },
+    { "equal", 0x3d }, { "greater", 0x3e }, { "question", 0x3f }, { "at", 0x40 },
+    { "bracketleft", 0x5b }, { "backslash", 0x5c }, { "bracketright", 0x5d },
+    { "asciicircum", 0x5e }, { "underscore", 0x5f }, { "grave", 0x60 }, { "quoteleft", 0x60 },
+    { "braceleft", 0x7b }, { "bar", 0x7c }, { "braceright", 0x7d }, { "asciitilde", 0x7e },
+    { "nobreakspace", 0xa0 }, { "exclamdown", 0xa1 }, { "cent", 0xa2 }, { "sterling", 0xa3 },
+    { "currency", 0xa4 }, { "yen", 0xa5 }, { "brokenbar", 0xa6 }, { "section", 0xa7 },
+    { "diaeresis", 0xa8 }, { "copyright", 0xa9 }, { "ordfeminine", 0xaa },
+    { "guillemotleft", 0xab }, { "guillemetleft", 0xab }, { "notsign", 0xac }, { "hyphen", 0xad },
+    { "registered", 0xae }, { "macron", 0xaf }, { "degree", 0xb0 }, { "plusminus", 0xb1 },
+    { "twosuperior", 0xb2 }, { "threesuperior", 0xb3 }, { "acute", 0xb4 }, { "mu", 0xb5 },
+    { "paragraph", 0xb6 }, { "periodcentered", 0xb7 }, { "cedilla", 0xb8 },
+    { "onesuperior", 0xb9 }, { "masculine", 0xba }, { "ordmasculine", 0xba },
+    { "guillemotright", 0xbb }, { "guillemetright", 0xbb }, { "onequarter", 0xbc },
+    { "onehalf", 0xbd }, { "threequarters", 0xbe }, { "questiondown", 0xbf },
+    { "Agrave", 0xc0 }, { "Aacute", 0xc1 }, { "Acircumflex", 0xc2 }, { "Atilde", 0xc3 },
+    { "Adiaeresis", 0xc4 }, { "Aring", 0xc5 }, { "AE", 0xc6 }, { "Ccedilla", 0xc7 },
+    { "Egrave", 0xc8 }, { "Eacute", 0xc9 }, { "Ecircumflex", 0xca }, { "Ediaeresis", 0xcb },
+    { "Igrave", 0xcc }, { "Iacute", 0xcd }, { "Icircumflex", 0xce }, { "Idiaeresis", 0xcf },
+    { "ETH", 0xd0 }, { "Eth", 0xd0 }, { "Ntilde", 0xd1 }, { "Ograve", 0xd2 }, { "Oacute", 0xd3 },
+    { "Ocircumflex", 0xd4 }, { "Otilde", 0xd5 }, { "Odiaeresis", 0xd6 }, { "multiply", 0xd7 },
+    { "Oslash", 0xd8 }, { "Ooblique", 0xd8 }, { "Ugrave", 0xd9 }, { "Uacute", 0xda },
+    { "Ucircumflex", 0xdb }, { "Udiaeresis", 0xdc }, { "Yacute", 0xdd }, { "THORN", 0xde },
+    { "Thorn", 0xde }, { "ssharp", 0xdf }, { "agrave", 0xe0 }, { "aacute", 0xe1 },
+    { "acircumflex", 0xe2 }, { "atilde", 0xe3 }, { "adiaeresis", 0xe4 }, { "aring", 0xe5 },
+    { "ae", 0xe6 }, { "ccedilla", 0xe7 }, { "egrave", 0xe8 }, { "eacute", 0xe9 },
+    { "ecircumflex", 0xea }, { "ediaeresis", 0xeb }, { "igrave", 0xec }, { "iacute", 0xed },
+    { "icircumflex", 0xee }, { "idiaeresis", 0xef }, { "eth", 0xf0 }, { "ntilde", 0xf1 },
+    { "ograve", 0xf2 }, { "oacute", 0xf3 }, { "ocircumflex", 0xf4 }, { "otilde", 0xf5 },
+    { "odiaeresis", 0xf6 }, { "division", 0xf7 }, { "oslash", 0xf8 }, { "ooblique", 0xf8 },
+    { "ugrave", 0xf9 }, { "uacute", 0xfa }, { "ucircumflex", 0xfb }, { "udiaeresis", 0xfc },
+    { "yacute", 0xfd }, { "thorn", 0xfe }, { "ydiaeresis", 0xff },
+    { "OE", 0x152 }, { "oe", 0x153 }, { "Lstroke", 0x141 }, { "lstroke", 0x142 },
+    { "ENG", 0x14a }, { "eng", 0x14b }, { "endash", 0x2013 }, { "emdash", 0x2014 },
+    { "leftsinglequotemark", 0x2018 }, { "rightsinglequotemark", 0x2019 },
+    { "singlelowquotemark", 0x201a }, { "leftdoublequotemark", 0x201c },
+    { "rightdoublequotemark", 0x201d }, { "doublelowquotemark", 0x201e },
+    { "ellipsis", 0x2026 }, { "EuroSign", 0x20ac }, { "leftarrow", 0x2190 },
+    { "uparrow", 0x2191 }, { "rightarrow", 0x2192 }, { "downarrow", 0x2193 },
+    { "Return", '\n' }, { "Tab", '\t' }, { "BackSpace", '\b' }, { "Escape", 0x1b },
+    { "dead_grave", DEAD_BASE + DEAD_GRAVE }, { "dead_acute", DEAD_BASE + DEAD_ACUTE },
+    { "dead_circumflex", DEAD_BASE + DEAD_CIRCUMFLEX }, { "dead_tilde", DEAD_BASE + DEAD_TILDE },
+    { "dead_diaeresis", DEAD_BASE + DEAD_DIAERESIS }, { "dead_abovering", DEAD_BASE + DEAD_ABOVERING },
+    { "dead_cedilla", DEAD_BASE + DEAD_CEDILLA }, { "ISO_Level3_Shift", LEVEL3_SHIFT },
+};
+
+// Characters typed as dead key + base (base ' ' gives the accent itself)
+struct compose { uint8_t dead; char base; uint32_t cp; };
+static const struct compose compositions[] = {
+    { DEAD_GRAVE, 'A', 0xc0 }, { DEAD_GRAVE, 'E', 0xc8 }, { DEAD_GRAVE, 'I', 0xcc },
+    { DEAD_GRAVE, 'O', 0xd2 }, { DEAD_GRAVE, 'U', 0xd9 }, { DEAD_GRAVE, 'a', 0xe0 },
+    { DEAD_GRAVE, 'e', 0xe8 }, { DEAD_GRAVE, 'i', 0xec }, { DEAD_GRAVE, 'o', 0xf2 },
+    { DEAD_GRAVE, 'u', 0xf9 }, { DEAD_GRAVE, ' ', '`' },
+    { DEAD_ACUTE, 'A', 0xc1 }, { DEAD_ACUTE, 'E', 0xc9 }, { DEAD_ACUTE, 'I', 0xcd },
+    { DEAD_ACUTE, 'O', 0xd3 }, { DEAD_ACUTE, 'U', 0xda }, { DEAD_ACUTE, 'Y', 0xdd },
+    { DEAD_ACUTE, 'a', 0xe1 }, { DEAD_ACUTE, 'e', 0xe9 }, { DEAD_ACUTE, 'i', 0xed },
+    { DEAD_ACUTE, 'o', 0xf3 }, { DEAD_ACUTE, 'u', 0xfa }, { DEAD_ACUTE, 'y', 0xfd },
+    { DEAD_ACUTE, ' ', '\'' },
+    { DEAD_CIRCUMFLEX, 'A', 0xc2 }, { DEAD_CIRCUMFLEX, 'E', 0xca }, { DEAD_CIRCUMFLEX, 'I', 0xce },
+    { DEAD_CIRCUMFLEX, 'O', 0xd4 }, { DEAD_CIRCUMFLEX, 'U', 0xdb }, { DEAD_CIRCUMFLEX, 'a', 0xe2 },
+    { DEAD_CIRCUMFLEX, 'e', 0xea }, { DEAD_CIRCUMFLEX, 'i', 0xee }, { DEAD_CIRCUMFLEX, 'o', 0xf4 },
+    { DEAD_CIRCUMFLEX, 'u', 0xfb }, { DEAD_CIRCUMFLEX, ' ', '^' },
+    { DEAD_TILDE, 'A', 0xc3 }, { DEAD_TILDE, 'N', 0xd1 }, { DEAD_TILDE, 'O', 0xd5 },
+    { DEAD_TILDE, 'a', 0xe3 }, { DEAD_TILDE, 'n', 0xf1 }, { DEAD_TILDE, 'o', 0xf5 },
+    { DEAD_TILDE, ' ', '~' },
+    { DEAD_DIAERESIS, 'A', 0xc4 }, { DEAD_DIAERESIS, 'E', 0xcb }, { DEAD_DIAERESIS, 'I', 0xcf },
+    { DEAD_DIAERESIS, 'O', 0xd6 }, { DEAD_DIAERESIS, 'U', 0xdc }, { DEAD_DIAERESIS, 'a', 0xe4 },
+    { DEAD_DIAERESIS, 'e', 0xeb }, { DEAD_DIAERESIS, 'i', 0xef }, { DEAD_DIAERESIS, 'o', 0xf6 },
+    { DEAD_DIAERESIS, 'u', 0xfc }, { DEAD_DIAERESIS, 'y', 0xff }, { DEAD_DIAERESIS, ' ', '"' },
+    { DEAD_ABOVERING, 'A', 0xc5 }, { DEAD_ABOVERING, 'a', 0xe5 },
+    { DEAD_CEDILLA, 'C', 0xc7 }, { DEAD_CEDILLA, 'c', 0xe7 },
+};
+
+// Resolve a keysym name to a codepoint / dead key, or -1 if unknown
+static int32_t keysym_value(const char *s, size_t len) {
+    char name[64];
+    if (len == 0 || len >= sizeof(name)) return -1;
+    memcpy(name, s, len);
+    name[len] = '\0';
+    if (len == 1 && name[0] > ' ' && name[0] < 0x7f)
+        return name[0];                                 // a, A, 1, ...
+    if (name[0] == 'U' && len >= 5 && len <= 7) {       // U20AC
+        char *end;
+        long v = strtol(name + 1, &end, 16);
+        if (*end == '\0' && v > 0 && v < 0x110000) return v;
+    }
+    if (name[0] == '0' && (name[1] == 'x' || name[1] == 'X')) {
+        char *end;
+        long v = strtol(name, &end, 16);
+        if (*end != '\0') return -1;
+        if (v >= 0x01000000 && v < 0x01110000) return v - 0x01000000;
+        if (v > 0x20 && v < 0x100) return v;
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(keysym_names) / sizeof(*keysym_names); i++)
+        if (strcmp(keysym_names[i].name, name) == 0)
+            return keysym_names[i].cp;
+    return -1;
+}
+
+/* Lexer */
+
+enum { T_EOF, T_IDENT, T_KEYNAME, T_STRING, T_PUNCT };
+struct token { int type; const char *s; size_t len; };
+struct lexer { const char *p, *end; struct token tok; };
+
+static void next(struct lexer *lx) {
+    const char *p = lx->p, *end = lx->end;
+    struct token *t = &lx->tok;
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+        if (p + 1 < end && ((p[0] == '/' && p[1] == '/') || p[0] == '#')) {
+            while (p < end && *p != '\n') p++;
+            continue;
+        }
+        if (p + 1 < end && p[0] == '/' && p[1] == '*') {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/')) p++;
+            p = p + 2 < end ? p + 2 : end;
+            continue;
+        }
+        break;
+    }
+    if (p >= end) {
+        t->type = T_EOF;
+        t->s = p;
+        t->len = 0;
+    } else if (*p == '<' || *p == '"') {
+        char close = *p == '<' ? '>' : '"';
+        const char *s = ++p;
+        while (p < end && *p != close) p++;
+        t->type = close == '>' ? T_KEYNAME : T_STRING;
+        t->s = s;
+        t->len = p - s;
+        if (p < end) p++;
+    } else if (*p == '_' || (*p >= '0' && *p <= '9') || ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z')) {
+        const char *s = p;
+        while (p < end && (*p == '_' || (*p >= '0' && *p <= '9') || ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z')))
+            p++;
+        t->type = T_IDENT;
+        t->s = s;
+        t->len = p - s;
+    } else {
+        t->type = T_PUNCT;
+        t->s = p++;
+        t->len = 1;
+    }
+    lx->p = p;
+}
+
+static int is_ident(const struct lexer *lx, const char *word) {
+    return lx->tok.type == T_IDENT && lx->tok.len == strlen(word)
+        && strncasecmp(lx->tok.s, word, lx->tok.len) == 0;
+}
+
+static int is_punct(const struct lexer *lx, char c) {
+    return lx->tok.type == T_PUNCT && lx->tok.s[0] == c;
+}
+
+// Skip past the ';' ending the current statement, or up to the '}'
+// closing the enclosing block, which is left unread
+static void skip_statement(struct lexer *lx) {
+    int depth = 0;
+    while (lx->tok.type != T_EOF) {
+        if (is_punct(lx, '{') || is_punct(lx, '[') || is_punct(lx, '(')) depth++;
+        else if (is_punct(lx, '}') || is_punct(lx, ']') || is_punct(lx, ')')) {
+            if (depth == 0) return;
+            depth--;
+        } else if (depth == 0 && is_punct(lx, ';')) {
+            next(lx);
+            return;
+        }
+        next(lx);
+    }
+}
+
+// Advance to the ',' or '}' ending the current component of a key block
+static void skip_component(struct lexer *lx) {
+    int depth = 0;
+    while (lx->tok.type != T_EOF) {
+        if (is_punct(lx, '{') || is_punct(lx, '[') || is_punct(lx, '(')) depth++;
+        else if (is_punct(lx, '}') || is_punct(lx, ']') || is_punct(lx, ')')) {
+            if (depth == 0) return;
+            depth--;
+        } else if (depth == 0 && is_punct(lx, ',')) {
+            return;
+        }
+        next(lx);
+    }
+}
+
+// Consume the '}' ending a section body and its trailing ';'
+static void end_block(struct lexer *lx) {
+    next(lx);
+    if (is_punct(lx, ';')) next(lx);
+}
+
+// Skip a { ... } block starting at the current '{' (and its trailing ';')
+static void skip_block(struct lexer *lx) {
+    while (lx->tok.type != T_EOF && !is_punct(lx, '{')) next(lx);
+    int depth = 0;
+    while (lx->tok.type != T_EOF) {
+        if (is_punct(lx, '{')) depth++;
+        else if (is_punct(lx, '}') && --depth == 0) {
+            next(lx);
+            if (is_punct(lx, ';')) next(lx);
+            return;
+        }
+        next(lx);
+    }
+}
+
+/* Compiler state */
+
+struct keyname { char name[8]; int code; };
+
+struct compiler {
+    struct keyname *names;
+    size_t nnames, cap;
+    struct layout_entry *ent;              // by codepoint, built up during parse
+    size_t nent, entcap;
+    struct { int code, mods; } dead[NUM_DEAD];
+    int altgr_code;
+};
+
+static int keycode_of(const struct compiler *c, const struct token *t) {
+    for (size_t i = 0; i < c->nnames; i++)
+        if (strlen(c->names[i].name) == t->len && memcmp(c->names[i].name, t->s, t->len) == 0)
+            return c->names[i].code;
+    return -1;
+}
+
+static int add_keyname(struct compiler *c, const struct token *t, int code) {
+    if (t->len >= sizeof(c->names->name)) return 0;
+    if (c->nnames == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 256;
+        struct keyname *n = realloc(c->names, cap * sizeof(*n));
+        if (!n) return -1;
+        c->names = n;
+        c->cap = cap;
+    }
+    memcpy(c->names[c->nnames].name, t->s, t->len);
+    c->names[c->nnames].name[t->len] = '\0';
+    c->names[c->nnames++].code = code;
+    return 0;
+}
+
+static struct layout_entry *find_entry(struct compiler *c, uint32_t cp) {
+    for (size_t i = 0; i < c->nent; i++)
+        if (c->ent[i].cp == cp) return &c->ent[i];
+    return NULL;
+}
+
+static int popcount8(unsigned v) { return __builtin_popcount(v); }
+
+static int append_entry(struct compiler *c, const struct layout_entry *e) {
+    if (c->nent == c->entcap) {
+        size_t cap = c->entcap ? c->entcap * 2 : 512;
+        struct layout_entry *n = realloc(c->ent, cap * sizeof(*n));
+        if (!n) return -1;
+        c->ent = n;
+        c->entcap = cap;
+    }
+    c->ent[c->nent++] = *e;
+    return 0;
+}
+
+// Record cp on (code, mods), keeping the variant with the fewest modifiers
+static int add_symbol(struct compiler *c, int32_t v, int code, int mods) {
+    if (v == LEVEL3_SHIFT) {
+        if (!mods && !c->altgr_code) c->altgr_code = code;
+        return 0;
+    }
+    if (v >= DEAD_BASE) {
+        int d = v - DEAD_BASE;
+        if (d < NUM_DEAD && (!c->dead[d].code || popcount8(mods) < popcount8(c->dead[d].mods))) {
+            c->dead[d].code = code;
+            c->dead[d].mods = mods;
+        }
+        return 0;
+    }
+    struct layout_entry *e = find_entry(c, v);
+    if (e) {
+        if (popcount8(mods) < popcount8(e->mods[0])) {
+            e->code[0] = code;
+            e->mods[0] = mods;
+        }
+        return 0;
+    }
+    struct layout_entry one = { .cp = v, .nkeys = 1, .mods = { mods }, .code = { code } };
+    return append_entry(c, &one);
+}
+
+// xkb_keycodes { <NAME> = 38; alias <A> = <B>; ... };
+static int parse_keycodes(struct compiler *c, struct lexer *lx) {
+    while (lx->tok.type != T_EOF && !is_punct(lx, '{')) next(lx);
+    next(lx);
+    while (lx->tok.type != T_EOF && !is_punct(lx, '}')) {
+        if (lx->tok.type == T_KEYNAME) {
+            struct token name = lx->tok;
+            next(lx);
+            if (is_punct(lx, '=')) {
+                next(lx);
+                if (lx->tok.type == T_IDENT && add_keyname(c, &name, atoi(lx->tok.s) - 8) < 0)
+                    return -1;
+            }
+        } else if (is_ident(lx, "alias")) {
+            next(lx);
+            struct token alias = lx->tok;
+            next(lx);
+            if (is_punct(lx, '=')) next(lx);
+            int code = lx->tok.type == T_KEYNAME ? keycode_of(c, &lx->tok) : -1;
+            if (alias.type == T_KEYNAME && code >= 0 && add_keyname(c, &alias, code) < 0)
+                return -1;
+        }
+        skip_statement(lx);
+    }
+    end_block(lx);
+    return 0;
+}
+
+// Parse a "[ sym, sym, ... ]" list at the current '[' into up to 4 levels
+static void parse_levels(struct lexer *lx, int32_t levels[4]) {
+    int n = 0;
+    next(lx);
+    while (lx->tok.type != T_EOF && !is_punct(lx, ']')) {
+        if (lx->tok.type == T_IDENT && n < 4)
+            levels[n] = keysym_value(lx->tok.s, lx->tok.len);
+        else if (is_punct(lx, ','))
+            n++;
+        next(lx);
+    }
+    next(lx);
+}
+
+// key <NAME> { [ a, A ] };  or  { type= "...", symbols[Group1]= [ ... ], actions... };
+static int parse_key(struct compiler *c, struct lexer *lx) {
+    next(lx);
+    int code = lx->tok.type == T_KEYNAME ? keycode_of(c, &lx->tok) : -1;
+    int32_t levels[4] = { -1, -1, -1, -1 };
+    int have_levels = 0, keypad = 0;
+    next(lx);
+    if (!is_punct(lx, '{')) {
+        skip_statement(lx);
+        return 0;
+    }
+    next(lx);
+    while (lx->tok.type != T_EOF && !is_punct(lx, '}')) {
+        if (is_punct(lx, '[') && !have_levels) {         // bare list: group 1 symbols
+            parse_levels(lx, levels);
+            have_levels = 1;
+        } else if (is_ident(lx, "symbols")) {
+            int group1 = 1;
+            next(lx);
+            if (is_punct(lx, '[')) {
+                next(lx);
+                group1 = is_ident(lx, "group1") || is_ident(lx, "1");
+                while (lx->tok.type != T_EOF && !is_punct(lx, ']')) next(lx);
+                next(lx);
+            }
+            if (is_punct(lx, '=')) next(lx);
+            if (group1 && is_punct(lx, '[') && !have_levels) {
+                parse_levels(lx, levels);
+                have_levels = 1;
+            }
+        } else if (is_ident(lx, "type")) {
+            while (lx->tok.type != T_EOF && lx->tok.type != T_STRING && !is_punct(lx, ',') && !is_punct(lx, '}'))
+                next(lx);
+            if (lx->tok.type == T_STRING && memmem(lx->tok.s, lx->tok.len, "KEYPAD", 6))
+                keypad = 1;
+        }
+        skip_component(lx);
+        if (is_punct(lx, ',')) next(lx);
+    }
+    next(lx);
+    if (is_punct(lx, ';')) next(lx);
+    if (code <= 0 || code > KEY_MAX || keypad) return 0;
+    static const int level_mods[4] = { 0, MOD_SHIFT, MOD_ALTGR, MOD_SHIFT | MOD_ALTGR };
+    for (int l = 0; l < 4; l++)
+        if (levels[l] >= 0 && add_symbol(c, levels[l], code, level_mods[l]) < 0)
+            return -1;
+    return 0;
+}
+
+static int parse_symbols(struct compiler *c, struct lexer *lx) {
+    while (lx->tok.type != T_EOF && !is_punct(lx, '{')) next(lx);
+    next(lx);
+    while (lx->tok.type != T_EOF && !is_punct(lx, '}')) {
+        if (is_ident(lx, "key")) {
+            if (parse_key(c, lx) < 0) return -1;
+        } else {
+            skip_statement(lx);
+        }
+    }
+    end_block(lx);
+    return 0;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    uint32_t x = ((const struct layout_entry *)a)->cp, y = ((const struct layout_entry *)b)->cp;
+    return x < y ? -1 : x > y;
+}
+
+// Compile keymap text into a malloc()ed, cp-sorted entry table
+static int compile_keymap(const char *text, size_t len, struct layout_entry **out, uint32_t *count, uint16_t *altgr) {
+    struct compiler c = { 0 };
+    struct lexer lx = { text, text + len, { 0 } };
+    int ret = 0;
+    next(&lx);
+    while (lx.tok.type != T_EOF && ret == 0) {
+        if (is_ident(&lx, "xkb_keycodes")) {
+            ret = parse_keycodes(&c, &lx);
+        } else if (is_ident(&lx, "xkb_symbols")) {
+            ret = parse_symbols(&c, &lx);
+        } else if (is_ident(&lx, "xkb_types") || is_ident(&lx, "xkb_compatibility")
+                   || is_ident(&lx, "xkb_compat") || is_ident(&lx, "xkb_geometry")) {
+            skip_block(&lx);
+        } else {
+            next(&lx);
+        }
+    }
+    if (ret == 0 && c.nent == 0) {
+        fprintf(stderr, "kbinsert: no usable key symbols found (is this a compiled xkb_keymap?)\n");
+        ret = -1;
+    }
+
+    // Characters missing from the layout but reachable via a dead key
+    for (size_t i = 0; ret == 0 && i < sizeof(compositions) / sizeof(*compositions); i++) {
+        const struct compose *k = &compositions[i];
+        struct layout_entry *base = find_entry(&c, (unsigned char)k->base);
+        if (!c.dead[k->dead].code || !base || base->nkeys != 1 || find_entry(&c, k->cp)) continue;
+        struct layout_entry e = { .cp = k->cp, .nkeys = 2,
+                                  .mods = { c.dead[k->dead].mods, base->mods[0] },
+                                  .code = { c.dead[k->dead].code, base->code[0] } };
+        ret = append_entry(&c, &e);
+    }
+
+    free(c.names);
+    if (ret < 0) {
+        free(c.ent);
+        return -1;
+    }
+    qsort(c.ent, c.nent, sizeof(*c.ent), cmp_entry);
+    *out = c.ent;
+    *count = c.nent;
+    *altgr = c.altgr_code ? c.altgr_code : KEY_RIGHTALT;
+    return 0;
+}
+
+/* Cache */
+
+static int cache_path(const char *src, char *out, size_t outlen) {
+    char abs[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char dir[PATH_MAX];
+    if (!realpath(src, abs)) return -1;
+    if (xdg && *xdg) snprintf(dir, sizeof(dir), "%s/kbinsert", xdg);
+    else if (home && *home) snprintf(dir, sizeof(dir), "%s/.cache/kbinsert", home);
+    else return -1;
+    uint64_t h = 0xcbf29ce484222325ULL;                     // FNV-1a of the path
+    for (const char *p = abs; *p; p++) h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    snprintf(out, outlen, "%s/layout-%016llx.bin", dir, (unsigned long long)h);
+    return 0;
+}
+
+static void mkdir_parent(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(dir, 0700);
+        *p = '/';
+    }
+}
+
+// Everything read from a cache file ends up in key bitmaps and on the
+// device, so a stale or damaged one must not name keys that can't exist
+static int cache_valid(const struct cache_hdr *h) {
+    const struct layout_entry *e = (const struct layout_entry *)(h + 1);
+    if (!h->altgr_code || h->altgr_code >= KEY_CNT) return 0;
+    for (uint32_t i = 0; i < h->count; i++) {
+        if ((e[i].nkeys != 1 && e[i].nkeys != 2) || (i && e[i].cp <= e[i - 1].cp))
+            return 0;
+        for (int k = 0; k < e[i].nkeys; k++)
+            if (!e[i].code[k] || e[i].code[k] >= KEY_CNT
+                || (e[i].mods[k] & ~(MOD_SHIFT | MOD_CTRL | MOD_ALTGR)))
+                return 0;
+    }
+    return 1;
+}
+
+static int cache_load(const char *path, const struct stat *src, struct layout *lo) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct cache_hdr)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    const struct cache_hdr *h = map;
+    if (memcmp(h->magic, CACHE_MAGIC, 8) != 0 || h->version != CACHE_VERSION
+        || h->src_size != (uint64_t)src->st_size || h->src_ino != (uint64_t)src->st_ino
+        || h->src_mtime_ns != src->st_mtim.tv_sec * 1000000000LL + src->st_mtim.tv_nsec
+        || (size_t)st.st_size != sizeof(*h) + h->count * sizeof(struct layout_entry)
+        || !cache_valid(h)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    lo->entries = (const struct layout_entry *)(h + 1);
+    lo->count = h->count;
+    lo->altgr_code = h->altgr_code;
+    lo->map = map;
+    lo->map_len = st.st_size;
+    return 0;
+}
+
+static void cache_store(const char *path, const struct stat *src, const struct layout *lo) {
+    char tmp[PATH_MAX + 16];
+    struct cache_hdr h = { CACHE_MAGIC, CACHE_VERSION, lo->count, src->st_size,
+                           src->st_mtim.tv_sec * 1000000000LL + src->st_mtim.tv_nsec,
+                           src->st_ino, lo->altgr_code, { 0 } };
+    mkdir_parent(path);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+          && fwrite(lo->entries, sizeof(*lo->entries), lo->count, f) == lo->count;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
+int layout_load(const char *path, struct layout *lo) {
+    char cpath[PATH_MAX + 64];
+    struct stat st;
+    memset(lo, 0, sizeof(*lo));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int cached = cache_path(path, cpath, sizeof(cpath)) == 0;
+    if (cached && cache_load(cpath, &st, lo) == 0) {
+        close(fd);
+        return 0;
+    }
+
+    char *text = malloc(st.st_size + 1);
+    ssize_t n = text ? read(fd, text, st.st_size) : -1;
+    close(fd);
+    if (n != st.st_size) {
+        fprintf(stderr, "kbinsert: can't read keymap %s\n", path);
+        free(text);
+        return -1;
+    }
+    struct layout_entry *ent;
+    int ret = compile_keymap(text, n, &ent, &lo->count, &lo->altgr_code);
+    free(text);
+    if (ret < 0) return -1;
+    lo->entries = ent;
+    lo->map = ent;
+    lo->map_len = 0;
+    if (cached) cache_store(cpath, &st, lo);
+    return 0;
+}
+
+const struct layout_entry *layout_lookup(const struct layout *lo, uint32_t cp) {
+    size_t lo_i = 0, hi = lo->count;
+    while (lo_i < hi) {
+        size_t mid = (lo_i + hi) / 2;
+        if (lo->entries[mid].cp < cp) lo_i = mid + 1;
+        else hi = mid;
+    }
+    return lo_i < lo->count && lo->entries[lo_i].cp == cp ? &lo->entries[lo_i] : NULL;
+}
+
+void layout_free(struct layout *lo) {
+    if (lo->map_len) munmap(lo->map, lo->map_len);
+    else free(lo->map);
+    memset(lo, 0, sizeof(*lo));
+}
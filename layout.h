@@ -0,0 +1,40 @@
+/* layout.h — keyboard layouts compiled from XKB keymaps for kbinsert
+ *
+ * A compiled keymap (as written by `xkbcomp $DISPLAY out.xkb` or
+ * `xkbcli compile-keymap --layout de`) is turned into a sorted table of
+ * codepoint → keystrokes. Characters reached through a dead key take two
+ * keystrokes. Tables are cached under $XDG_CACHE_HOME/kbinsert and
+ * mmap()ed on later runs.
+ */
+#ifndef KBINSERT_LAYOUT_H
+#define KBINSERT_LAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Modifier mask for a keystroke
+enum { MOD_SHIFT = 1, MOD_CTRL = 2, MOD_ALTGR = 4 };
+
+struct layout_entry {
+    uint32_t cp;         // Unicode codepoint
+    uint8_t  nkeys;      // 1, or 2 for dead key + base
+    uint8_t  mods[2];
+    uint8_t  pad;
+    uint16_t code[2];    // evdev KEY_* codes
+};
+
+struct layout {
+    const struct layout_entry *entries;   // sorted by cp
+    uint32_t count;
+    uint16_t altgr_code;                  // key selecting level 3 (ISO_Level3_Shift)
+    void *map;                            // mmap()ed cache file, or malloc()ed table
+    size_t map_len;
+};
+
+// Load the layout for an XKB keymap file, compiling it (and refreshing the
+// cache) if the cache is missing or stale. Returns 0, or -1 with a message.
+int layout_load(const char *path, struct layout *lo);
+const struct layout_entry *layout_lookup(const struct layout *lo, uint32_t cp);
+void layout_free(struct layout *lo);
+
+#endif
@@ -0,0 +1,1846 @@
+/* libkbinsert.c — the injection engine behind kbinsert: uinput device setup,
+ * escape and UTF-8 decoding, key tables, modifier state, pacing and event
+ * batching, all held in a struct kbi_ctx (see kbinsert.h)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <linux/uinput.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <termios.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include "kbinsert.h"
+#include "layout.h"
+#include "uring.h"
+
+// Pending events are queued here and written to uinput in one write().
+// Sized well above the 8 events a shifted/ctrl character needs.
+#define EVBUF_MAX 512
+
+// Escape-free runs are typed straight from the input; from a backslash on,
+// at most this many bytes are decoded into a scratch buffer at a time
+#define ESC_WINDOW 16
+
+// Byte → key + modifiers, resolved at compile time so the injection loop
+// does a single table lookup per byte. Unmapped bytes have code 0.
+// MOD_* masks come from layout.h.
+struct key_map { unsigned short code; unsigned char mods; };
+
+/* Key timing jitter, with fixed pacing: how far the interval between two
+ * paced writes is off the n / rate it should last for a batch of n
+ * characters, either way, in microseconds: exact below 64 us, then 32
+ * buckets per power of two (3% resolution).
+ */
+#define JIT_BUCKETS     (64 + 30 * 32)
+
+struct pacer {
+    struct kbi_pace spec;
+    double rate, tokens;
+    long long last_ns, start_ns;
+    int tty_fd;                // adaptive read-back, or -1
+    struct termios saved_tio, tio;
+    int have_tio;
+    long long expected;        // chars we expect to see in the tty queue
+    int recording;             // kbi_record(): count them into the script instead
+    unsigned recorded;         // ...for the batch being recorded
+    int base_inq, streak;
+    int seen;                  // has anything we typed ever shown up?
+    struct kbi_stats st;
+    struct kbi_prof *prof;
+    long long sent_ns;          // when the last paced write went out (0: unknown)
+    unsigned jit[JIT_BUCKETS];
+};
+
+/* io_uring engine: instead of write() + nanosleep() per batch, batches are
+ * copied into an arena and submitted as one linked chain of
+ * (absolute timeout → write) pairs, so the kernel does the pacing and a
+ * whole arena costs one io_uring_enter(). Two arenas alternate: one chain
+ * runs while the caller fills the other.
+ */
+#define URING_DEPTH     256                     // SQEs: a timeout and a write per batch
+#define ARENA_BATCHES   (URING_DEPTH / 2)
+#define ARENA_EVENTS    8192
+#define URING_SLACK_NS  20000                   // closer than this: no timeout, just write
+
+struct arena {
+    size_t nev;
+    unsigned nbatch;
+    struct { size_t off, len; long long due; int chars; } batch[ARENA_BATCHES];
+    struct __kernel_timespec ts[ARENA_BATCHES];  // read by the kernel until completion
+    struct input_event ev[ARENA_EVENTS];
+};
+
+struct async_engine {
+    struct uring ring;
+    struct arena arena[2];
+    int cur;                    // arena being filled
+    unsigned inflight;          // completions still due for the submitted one
+    int error;                  // first failed write (negative errno), sticky per text
+};
+
+/* Thread engine: the caller's thread decodes and maps, and copies each
+ * finished batch into a single-producer/single-consumer ring; an emitter
+ * thread, which does all the pacing and writing, takes them from there.
+ * Neither side waits for the other unless the ring is full or empty.
+ * A batch's events are kept contiguous (so it is still one write) by
+ * starting it over at the front when it doesn't fit at the end.
+ */
+#define PIPE_EVENTS     8192                    // events in flight (192 KiB)
+#define PIPE_BATCHES    1024
+
+struct pipe_batch { unsigned off, nev, chars; };
+
+struct pipeline {
+    struct input_event ev[PIPE_EVENTS];
+    struct pipe_batch batch[PIPE_BATCHES];
+    uint32_t head, tail;                        // batches queued / written (futex words)
+    int prod_waiting, cons_waiting;
+    unsigned ev_head;                           // producer: where the next events go
+    int stop, error;                            // error: a write failed, sticky per text
+    struct kbi_prof prof;                       // the emitter's, added up by pipe_drain()
+    pthread_t thread;
+};
+
+#define CP_CACHE        64                      // codepoint lookups remembered (direct-mapped)
+
+// Decoder state of one text stream (the typed one, or the kbi_scan() one)
+struct decoder {
+    struct kbi_esc esc;
+    uint32_t u8cp;          // UTF-8 character being assembled
+    int u8need, u8len;      // continuation bytes still expected / seen so far
+};
+
+struct kbi_ctx {
+    int fd;                             // uinput device, or -1
+    char ev_node[64];                   // /dev/input/eventN of our device, once known
+    int ready_timeout_ms;               // upper bound on waiting for the device
+    int report_ready;                   // print time-to-ready
+    char name[UINPUT_MAX_NAME_SIZE];    // device name
+    struct kbi_keys dev_keys;           // keys registered on the device
+
+    struct layout layout;
+    struct key_map layout_keymap[256];
+    const struct key_map *byte_map;
+    struct { uint32_t cp; const struct layout_entry *e; } cp_cache[CP_CACHE];  // misses too
+
+    // Current text (kbi_begin)
+    int flags, batch, tty_fd;
+    struct kbi_pace pace_spec;
+    struct pacer pace;
+    int pacing;                         // pacer started by the first kbi_inject()
+    struct decoder text, scan;
+    int held_mods, held_ctrl;
+
+    struct async_engine *async;         // kbi_set_engine(KBI_ENGINE_URING), else NULL
+    int async_on;                       // ... and in use for the current text
+    struct pipeline *pipe;              // kbi_set_engine(KBI_ENGINE_THREAD), else NULL
+    int pipe_on;                        // ... and in use for the current text
+
+    struct kbi_prof *prof;              // kbi_set_profile(), else NULL
+    int verify;                         // kbi_set_verify()
+    int vfd;                            // ... our evdev node, read back, or -1
+    size_t max_write;                   // events per write that arrive whole (0: no limit seen)
+    struct kbi_keys *collect;           // kbi_scan(): record keys instead of queueing
+    struct kbi_script *record;          // kbi_record(): append batches instead of writing
+    void (*hook)(void *arg, const struct input_event *ev, size_t n);
+    void *hook_arg;
+
+    size_t evlen;
+    struct input_event evbuf[EVBUF_MAX];
+    char dec[ESC_WINDOW + 4];
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *phase_names[KBI_PH_COUNT] = {
+    "other", "input", "scan", "setup", "ready", "decode", "map", "write", "sleep"
+};
+
+const char *kbi_phase_name(int phase) {
+    return (unsigned)phase < KBI_PH_COUNT ? phase_names[phase] : "?";
+}
+
+void kbi_prof_start(struct kbi_prof *pr) {
+    memset(pr, 0, sizeof(*pr));
+    pr->mark = now_ns();
+}
+
+int kbi_prof_phase(struct kbi_prof *pr, int phase) {
+    if (!pr) return 0;
+    long long now = now_ns();
+    int prev = pr->cur;
+    pr->phase_ns[prev] += now - pr->mark;
+    pr->cur = phase;
+    pr->mark = now;
+    return prev;
+}
+
+#define prof_count(pr, sys) do { if (pr) (pr)->calls[sys]++; } while (0)
+
+#define KEYSET_BITS (8 * sizeof(long))
+
+void kbi_keys_add(struct kbi_keys *ks, int code) {
+    ks->bits[code / KEYSET_BITS] |= 1UL << (code % KEYSET_BITS);
+}
+
+int kbi_keys_has(const struct kbi_keys *ks, int code) {
+    return (ks->bits[code / KEYSET_BITS] >> (code % KEYSET_BITS)) & 1;
+}
+
+// Is every key in need also in have?
+int kbi_keys_covers(const struct kbi_keys *have, const struct kbi_keys *need) {
+    for (size_t i = 0; i < sizeof(have->bits) / sizeof(*have->bits); i++)
+        if (need->bits[i] & ~have->bits[i]) return 0;
+    return 1;
+}
+
+void kbi_keys_union(struct kbi_keys *ks, const struct kbi_keys *other) {
+    for (size_t i = 0; i < sizeof(ks->bits) / sizeof(*ks->bits); i++)
+        ks->bits[i] |= other->bits[i];
+}
+
+static int async_queue(struct kbi_ctx *ctx, const struct input_event *ev, size_t nev, int chars, long long due);
+static int pipe_push(struct kbi_ctx *ctx, const struct input_event *ev, size_t nev, unsigned chars);
+static void sleep_ns(struct pacer *p, long long ns);
+
+/* A write() that fails with EAGAIN is retried after a backoff that
+ * starts at RETRY_NS and doubles up to RETRY_MAX_NS; a device that stays
+ * busy for RETRY_GIVEUP_NS fails the text.
+ */
+#define RETRY_NS        50000LL
+#define RETRY_MAX_NS    10000000LL
+#define RETRY_GIVEUP_NS 2000000000LL
+
+// Write events in a single syscall (retrying short writes)
+static int write_chunk(struct kbi_ctx *ctx, const struct input_event *ev, size_t nev) {
+    const char *p = (const char *)ev;
+    size_t left = nev * sizeof(*ev);
+    struct kbi_prof *pr = ctx->pace.prof;
+    long long backoff = 0, giveup = 0;
+    while (left > 0) {
+        long long t0 = pr ? now_ns() : 0;
+        ctx->pace.st.syscalls++;
+        ssize_t n = write(ctx->fd, p, left);
+        if (pr) {
+            long long dt = now_ns() - t0;
+            int b = dt > 1 ? 63 - __builtin_clzll(dt) : 0;
+            pr->hist[b < KBI_HIST ? b : KBI_HIST - 1]++;
+            pr->calls[KBI_SYS_WRITE]++;
+            if (n > 0) pr->bytes += n;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                if (!backoff) {
+                    backoff = RETRY_NS;
+                    giveup = now_ns() + RETRY_GIVEUP_NS;
+                } else if (now_ns() > giveup) {
+                    fprintf(stderr, "kbinsert: write: device busy for %lld ms, giving up\n",
+                            RETRY_GIVEUP_NS / 1000000);
+                    return -1;
+                }
+                ctx->pace.st.retries++;
+                sleep_ns(&ctx->pace, backoff);
+                if ((backoff *= 2) > RETRY_MAX_NS) backoff = RETRY_MAX_NS;
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+    return 0;
+}
+
+/* Read back what the input core delivered for the events just written.
+ * Delivery is synchronous, so they are all in the node's buffer (or lost)
+ * once write() returns; key events are matched in order, and written ones
+ * skipped over were not delivered. After SYN_DROPPED only the newest
+ * events made it: those are counted, and later writes kept to that size.
+ */
+static void verify_chunk(struct kbi_ctx *ctx, const struct input_event *ev, size_t nev) {
+    struct kbi_stats *st = &ctx->pace.st;
+    struct input_event in[64];
+    size_t i = 0, after_drop = 0;
+    long long got = 0;
+    int dropped = 0;
+    for (size_t k = 0; k < nev; k++)
+        if (ev[k].type == EV_KEY) st->keys_sent++;
+    for (;;) {
+        ssize_t r = read(ctx->vfd, in, sizeof(in));
+        st->syscalls++;
+        if (r <= 0) break;
+        for (size_t j = 0; j < r / sizeof(*in); j++) {
+            const struct input_event *e = &in[j];
+            if (e->type == EV_SYN && e->code == SYN_DROPPED) {
+                dropped = 1;
+                got = after_drop = 0;
+                continue;
+            }
+            after_drop++;
+            if (e->type != EV_KEY || e->value == 2) continue;
+            if (dropped) {
+                got++;
+                continue;
+            }
+            while (i < nev && !(ev[i].type == EV_KEY && ev[i].code == e->code && ev[i].value == e->value))
+                i++;
+            if (i < nev) {
+                got++;
+                i++;
+            }
+        }
+        if ((size_t)r < sizeof(in)) break;
+    }
+    st->keys_delivered += got;
+    if (dropped && after_drop && (!ctx->max_write || after_drop < ctx->max_write))
+        ctx->max_write = after_drop;
+}
+
+// Events to write at once: all of them, or as many whole reports as fit
+// in max_write (at least one)
+static size_t write_span(const struct kbi_ctx *ctx, const struct input_event *ev, size_t nev) {
+    size_t end = 0;
+    if (!ctx->max_write || nev <= ctx->max_write) return nev;
+    for (size_t i = 0; i < nev; i++) {
+        if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT) continue;
+        if (i + 1 > ctx->max_write && end) break;
+        end = i + 1;
+        if (end >= ctx->max_write) break;
+    }
+    return end ? end : nev;
+}
+
+// With the thread engine this runs on the emitter, with a profile of its own
+static int write_events(struct kbi_ctx *ctx, const struct input_event *ev, size_t nev) {
+    struct kbi_prof *pr = ctx->pace.prof;
+    int ret = 0, prev = kbi_prof_phase(pr, KBI_PH_WRITE);
+    if (ctx->hook && nev) ctx->hook(ctx->hook_arg, ev, nev);
+    while (nev > 0 && ret == 0) {
+        size_t n = ctx->vfd >= 0 ? write_span(ctx, ev, nev) : nev;
+        ret = write_chunk(ctx, ev, n);
+        if (ret == 0 && ctx->vfd >= 0) verify_chunk(ctx, ev, n);
+        ev += n;
+        nev -= n;
+    }
+    kbi_prof_phase(pr, prev);
+    return ret;
+}
+
+// Append the queued events to the script being recorded, as a batch of
+// chars characters (0: part of the next batch)
+static int record_batch(struct kbi_ctx *ctx, int chars) {
+    struct kbi_script *s = ctx->record;
+    if (!ctx->evlen && !chars) return 0;
+    if (s->nev + ctx->evlen > s->ev_cap) {
+        size_t cap = s->ev_cap ? s->ev_cap * 2 : 4096;
+        while (cap < s->nev + ctx->evlen) cap *= 2;
+        struct input_event *ev = realloc(s->ev, cap * sizeof(*ev));
+        if (!ev) goto nomem;
+        s->ev = ev;
+        s->ev_cap = cap;
+    }
+    if (s->nbatch == s->batch_cap) {
+        size_t cap = s->batch_cap ? s->batch_cap * 2 : 1024;
+        struct kbi_batch *b = realloc(s->batch, cap * sizeof(*b));
+        if (!b) goto nomem;
+        s->batch = b;
+        s->batch_cap = cap;
+    }
+    for (size_t i = 0; i < ctx->evlen; i++)
+        if (ctx->evbuf[i].type == EV_KEY) kbi_keys_add(&s->keys, ctx->evbuf[i].code);
+    memcpy(s->ev + s->nev, ctx->evbuf, ctx->evlen * sizeof(*ctx->evbuf));
+    s->batch[s->nbatch].chars = chars;
+    s->batch[s->nbatch].events = ctx->evlen;
+    s->batch[s->nbatch].tty = ctx->pace.recorded;
+    ctx->pace.recorded = 0;
+    s->nbatch++;
+    s->nev += ctx->evlen;
+    ctx->evlen = 0;
+    return 0;
+nomem:
+    perror("kbi_record");
+    ctx->evlen = 0;
+    return -1;
+}
+
+// Send all queued events now (after any batches already queued)
+static int flush_events(struct kbi_ctx *ctx) {
+    int ret;
+    if (ctx->record) return record_batch(ctx, 0);
+    if (ctx->async_on) ret = async_queue(ctx, ctx->evbuf, ctx->evlen, 0, 0);
+    else if (ctx->pipe_on) ret = pipe_push(ctx, ctx->evbuf, ctx->evlen, 0);
+    else ret = write_events(ctx, ctx->evbuf, ctx->evlen);
+    ctx->evlen = 0;
+    return ret;
+}
+
+// Queue a single input_event; only flushes on its own at a SYN_REPORT
+// boundary, so a full buffer never splits a key report across writes
+static int emit(struct kbi_ctx *ctx, int type, int code, int value) {
+    if (ctx->collect) {
+        if (type == EV_KEY) kbi_keys_add(ctx->collect, code);
+        return 0;
+    }
+    struct input_event *ie = &ctx->evbuf[ctx->evlen++];
+    memset(ie, 0, sizeof(*ie));
+    ie->type = type;
+    ie->code = code;
+    ie->value = value;
+    if (type == EV_SYN && ctx->evlen > EVBUF_MAX - 8)
+        return flush_events(ctx);
+    return 0;
+}
+
+/* Process escape sequences: \\, \n, \r, \xhh, \ooo, \^C
+ * Incremental: input may arrive in arbitrary chunks, and an escape split
+ * across a chunk boundary is carried over in the state. out must have
+ * room for len + 4 bytes. With final set, a trailing partial escape is
+ * emitted literally (a lone "\" stays "\", "\^" becomes "^", "\x4" "x4").
+ * Text between escapes is found 16/32 bytes at a time and copied in bulk.
+ */
+enum { ESC_NONE, ESC_BSLASH, ESC_CARET, ESC_HEX0, ESC_HEX1, ESC_OCT };
+
+// Hex digit values; -1 for anything else
+#define H(c, v) [c] = v + 1
+static const signed char hex_digit1[256] = {
+    H('0', 0), H('1', 1), H('2', 2), H('3', 3), H('4', 4),
+    H('5', 5), H('6', 6), H('7', 7), H('8', 8), H('9', 9),
+    H('a', 10), H('b', 11), H('c', 12), H('d', 13), H('e', 14), H('f', 15),
+    H('A', 10), H('B', 11), H('C', 12), H('D', 13), H('E', 14), H('F', 15),
+};
+#undef H
+#define hex_digit(c) (hex_digit1[(unsigned char)(c)] - 1)
+#define is_octal(c)  ((unsigned)((c) - '0') < 8)
+
+// Length of the escape-free run at the start of p (KBI_NO_SIMD: memchr
+// only, for make test)
+static size_t escape_free(const char *p, size_t len) {
+    size_t i = 0;
+    if (len == 0) return 0;     // feed() passes empty chunks as NULL, 0
+#if defined(__AVX2__) && !defined(KBI_NO_SIMD)
+    const __m256i bs32 = _mm256_set1_epi8('\\');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bs32));
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+#if defined(__SSE2__) && !defined(KBI_NO_SIMD)
+    const __m128i bs16 = _mm_set1_epi8('\\');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, bs16));
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+    const char *bs = memchr(p + i, '\\', len - i);
+    return bs ? (size_t)(bs - p) : len;
+}
+
+size_t kbi_decode_escapes(struct kbi_esc *st, const char *in, size_t len, char *out, int final) {
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = in[i];
+        switch (st->state) {
+        case ESC_NONE: {
+            size_t run = escape_free(in + i, len - i);
+            memcpy(out + j, in + i, run);
+            j += run;
+            i += run;
+            if (i < len) st->state = ESC_BSLASH;
+            continue;
+        }
+        case ESC_BSLASH:
+            st->state = ESC_NONE;
+            if (c == 'n')      out[j++] = '\n';
+            else if (c == 'r') out[j++] = '\r';
+            else if (c == '^') st->state = ESC_CARET;
+            else if (c == 'x') st->state = ESC_HEX0;
+            else if (is_octal(c)) { st->val = c - '0'; st->cnt = 1; st->state = ESC_OCT; }
+            else               out[j++] = c;       // includes "\\"
+            continue;
+        case ESC_CARET:
+            st->state = ESC_NONE;
+            c = toupper(c);
+            if (c >= '@' && c <= '_') {
+                out[j++] = c - 64;
+            } else {
+                out[j++] = '^';
+                out[j++] = c;
+            }
+            continue;
+        case ESC_HEX0:
+            if (hex_digit(c) >= 0) { st->hex1 = c; st->state = ESC_HEX1; continue; }
+            out[j++] = 'x';
+            break;
+        case ESC_HEX1:
+            if (hex_digit(c) >= 0) {
+                out[j++] = (char)(hex_digit(st->hex1) * 16 + hex_digit(c));
+                st->state = ESC_NONE;
+                continue;
+            }
+            out[j++] = 'x';
+            out[j++] = st->hex1;
+            break;
+        case ESC_OCT:
+            if (is_octal(c)) {
+                st->val = st->val * 8 + (c - '0');
+                if (++st->cnt == 3) { out[j++] = (char)st->val; st->state = ESC_NONE; }
+                continue;
+            }
+            out[j++] = (char)st->val;
+            break;
+        }
+        // The pending escape ended without consuming c: handle it afresh
+        st->state = ESC_NONE;
+        i--;
+    }
+    if (final) {
+        switch (st->state) {
+        case ESC_BSLASH: out[j++] = '\\'; break;
+        case ESC_CARET:  out[j++] = '^'; break;
+        case ESC_HEX0:   out[j++] = 'x'; break;
+        case ESC_HEX1:   out[j++] = 'x'; out[j++] = st->hex1; break;
+        case ESC_OCT:    out[j++] = (char)st->val; break;
+        }
+        st->state = ESC_NONE;
+    }
+    return j;
+}
+
+#define K(c, k)  [c] = { k, 0 }
+#define SK(c, k) [c] = { k, MOD_SHIFT }
+#define CK(c, k) [c] = { k, MOD_CTRL }
+static const struct key_map ascii_keymap[256] = {
+    K('a', KEY_A), K('b', KEY_B), K('c', KEY_C), K('d', KEY_D), K('e', KEY_E),
+    K('f', KEY_F), K('g', KEY_G), K('h', KEY_H), K('i', KEY_I), K('j', KEY_J),
+    K('k', KEY_K), K('l', KEY_L), K('m', KEY_M), K('n', KEY_N), K('o', KEY_O),
+    K('p', KEY_P), K('q', KEY_Q), K('r', KEY_R), K('s', KEY_S), K('t', KEY_T),
+    K('u', KEY_U), K('v', KEY_V), K('w', KEY_W), K('x', KEY_X), K('y', KEY_Y),
+    K('z', KEY_Z),
+    SK('A', KEY_A), SK('B', KEY_B), SK('C', KEY_C), SK('D', KEY_D), SK('E', KEY_E),
+    SK('F', KEY_F), SK('G', KEY_G), SK('H', KEY_H), SK('I', KEY_I), SK('J', KEY_J),
+    SK('K', KEY_K), SK('L', KEY_L), SK('M', KEY_M), SK('N', KEY_N), SK('O', KEY_O),
+    SK('P', KEY_P), SK('Q', KEY_Q), SK('R', KEY_R), SK('S', KEY_S), SK('T', KEY_T),
+    SK('U', KEY_U), SK('V', KEY_V), SK('W', KEY_W), SK('X', KEY_X), SK('Y', KEY_Y),
+    SK('Z', KEY_Z),
+    K('1', KEY_1), K('2', KEY_2), K('3', KEY_3), K('4', KEY_4), K('5', KEY_5),
+    K('6', KEY_6), K('7', KEY_7), K('8', KEY_8), K('9', KEY_9), K('0', KEY_0),
+    K(' ', KEY_SPACE), K('\n', KEY_ENTER), K('\r', KEY_ENTER),
+    K('-', KEY_MINUS), K('=', KEY_EQUAL), K('[', KEY_LEFTBRACE), K(']', KEY_RIGHTBRACE),
+    K('\\', KEY_BACKSLASH), K(';', KEY_SEMICOLON), K('\'', KEY_APOSTROPHE),
+    K(',', KEY_COMMA), K('.', KEY_DOT), K('/', KEY_SLASH), K('`', KEY_GRAVE),
+    SK('!', KEY_1), SK('@', KEY_2), SK('#', KEY_3), SK('$', KEY_4), SK('%', KEY_5),
+    SK('^', KEY_6), SK('&', KEY_7), SK('*', KEY_8), SK('(', KEY_9), SK(')', KEY_0),
+    SK('_', KEY_MINUS), SK('+', KEY_EQUAL), SK('{', KEY_LEFTBRACE), SK('}', KEY_RIGHTBRACE),
+    SK('|', KEY_BACKSLASH), SK(':', KEY_SEMICOLON), SK('"', KEY_APOSTROPHE),
+    SK('<', KEY_COMMA), SK('>', KEY_DOT), SK('?', KEY_SLASH), SK('~', KEY_GRAVE),
+    // Control chars → ctrl+letter (\n and \r above are Enter instead)
+    CK(1, KEY_A),  CK(2, KEY_B),  CK(3, KEY_C),  CK(4, KEY_D),  CK(5, KEY_E),
+    CK(6, KEY_F),  CK(7, KEY_G),  CK(8, KEY_H),  CK(9, KEY_I),  CK(11, KEY_K),
+    CK(12, KEY_L), CK(14, KEY_N), CK(15, KEY_O), CK(16, KEY_P), CK(17, KEY_Q),
+    CK(18, KEY_R), CK(19, KEY_S), CK(20, KEY_T), CK(21, KEY_U), CK(22, KEY_V),
+    CK(23, KEY_W), CK(24, KEY_X), CK(25, KEY_Y), CK(26, KEY_Z),
+};
+#undef K
+#undef SK
+#undef CK
+
+// Forget cached codepoint lookups (the layout changed)
+static void cp_cache_clear(struct kbi_ctx *ctx) {
+    for (int i = 0; i < CP_CACHE; i++) ctx->cp_cache[i].cp = UINT32_MAX;
+}
+
+/* With a keymap, the byte table is rebuilt from an XKB layout instead (US
+ * QWERTY above is the default). Bytes that need two keystrokes (dead keys)
+ * and non-ASCII characters are looked up in the layout itself.
+ */
+int kbi_set_keymap(struct kbi_ctx *ctx, const char *path) {
+    struct layout lo;
+    if (layout_load(path, &lo) < 0) return -1;
+    if (ctx->layout.count) layout_free(&ctx->layout);
+    ctx->layout = lo;
+    cp_cache_clear(ctx);
+    struct key_map *km = ctx->layout_keymap;
+    memset(km, 0, sizeof(ctx->layout_keymap));
+    for (int c = 0; c < 128; c++) {
+        const struct layout_entry *e = layout_lookup(&lo, c);
+        if (e && e->nkeys == 1)
+            km[c] = (struct key_map){ e->code[0], e->mods[0] };
+    }
+    // Control chars are still ctrl+letter, wherever the letter lives
+    for (int c = 1; c <= 26; c++) {
+        const struct layout_entry *e = layout_lookup(&lo, 'a' + c - 1);
+        if (c == '\n' || c == '\r') continue;
+        km[c] = e && e->nkeys == 1
+            ? (struct key_map){ e->code[0], (e->mods[0] & ~MOD_SHIFT) | MOD_CTRL }
+            : (struct key_map){ 0, 0 };
+    }
+    if (!km['\r'].code) km['\r'] = km['\n'];
+    ctx->byte_map = km;
+    return 0;
+}
+
+// Find the eventN handler the input core attached to our inputN device
+static int find_event_node(const char *sysname, char *out, size_t outlen) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    struct dirent *de;
+    int found = -1;
+    while ((de = readdir(d))) {
+        if (strncmp(de->d_name, "event", 5) == 0) {
+            // A name that doesn't fit can't be ours
+            if ((size_t)snprintf(out, outlen, "/dev/input/%s", de->d_name) < outlen) found = 0;
+            break;
+        }
+    }
+    closedir(d);
+    return found;
+}
+
+// Does pid hold an open fd on node (or, with node NULL, on any evdev node)?
+static int pid_holds(const char *pid, const char *node) {
+    char path[300], target[64];
+    snprintf(path, sizeof(path), "/proc/%s/fd", pid);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    struct dirent *de;
+    int held = 0;
+    while (!held && (de = readdir(d))) {
+        if (de->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "/proc/%s/fd/%s", pid, de->d_name);
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        if (n <= 0) continue;
+        target[n] = '\0';
+        held = node ? strcmp(target, node) == 0
+                    : strncmp(target, "/dev/input/event", 16) == 0;
+    }
+    closedir(d);
+    return held;
+}
+
+// Collect pids (other than us) that have evdev nodes open: X, compositors, logind
+#define MAX_READERS 32
+static int find_input_readers(pid_t *pids) {
+    DIR *d = opendir("/proc");
+    if (!d) return 0;
+    struct dirent *de;
+    int n = 0;
+    pid_t self = getpid();
+    while (n < MAX_READERS && (de = readdir(d))) {
+        if (!isdigit((unsigned char)de->d_name[0])) continue;
+        pid_t pid = atoi(de->d_name);
+        if (pid != self && pid_holds(de->d_name, NULL))
+            pids[n++] = pid;
+    }
+    closedir(d);
+    return n;
+}
+
+/* Wait until the new device is usable instead of a fixed sleep(1):
+ *  1. its /dev/input/eventN node exists (inotify on /dev/input), and
+ *  2. if anything in userspace reads input devices (X, a compositor),
+ *     one of those processes has opened our node.
+ * The console keyboard handler attaches inside the kernel, so with no
+ * userspace readers the device is ready as soon as the node appears.
+ * Gives up after ready_timeout_ms and injects anyway.
+ */
+static void wait_for_device(struct kbi_ctx *ctx) {
+    int timeout_ms = ctx->ready_timeout_ms;
+    char *ev_node = ctx->ev_node;
+    long long t0 = now_ns(), deadline = t0 + timeout_ms * 1000000LL;
+    long long t_node = 0;
+    char sysname[32];
+    pid_t readers[MAX_READERS];
+    int nreaders = 0, opened_by = 0;
+
+    ev_node[0] = '\0';
+    if (ioctl(ctx->fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+        // Old kernel: nothing to watch, fall back to the bounded wait
+        usleep(timeout_ms * 1000);
+        if (ctx->report_ready) fprintf(stderr, "kbinsert: UI_GET_SYSNAME unsupported, waited %d ms\n", timeout_ms);
+        return;
+    }
+
+    // Watch before looking so a node created in between isn't missed
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= 0) inotify_add_watch(ifd, "/dev/input", IN_CREATE | IN_ATTRIB);
+
+    for (;;) {
+        struct stat st;
+        if ((ev_node[0] || find_event_node(sysname, ev_node, sizeof(ctx->ev_node)) == 0)
+            && stat(ev_node, &st) == 0)
+            break;
+        long long left = deadline - now_ns();
+        if (left <= 0) goto done;
+        if (ifd >= 0) {
+            struct pollfd pfd = { ifd, POLLIN, 0 };
+            char buf[4096];
+            if (poll(&pfd, 1, (int)(left / 1000000) + 1) > 0)
+                while (read(ifd, buf, sizeof(buf)) > 0)
+                    ;
+        } else {
+            usleep(1000);
+        }
+    }
+    t_node = now_ns();
+
+    nreaders = find_input_readers(readers);
+    while (nreaders > 0 && now_ns() < deadline) {
+        for (int i = 0; i < nreaders && !opened_by; i++) {
+            char pid[16];
+            snprintf(pid, sizeof(pid), "%d", (int)readers[i]);
+            if (pid_holds(pid, ev_node)) opened_by = readers[i];
+        }
+        if (opened_by) break;
+        usleep(2000);
+    }
+
+done:
+    if (ifd >= 0) close(ifd);
+    if (ctx->report_ready) {
+        double total_ms = (now_ns() - t0) / 1e6;
+        if (!t_node)
+            fprintf(stderr, "kbinsert: %s: no device node after %.1f ms, continuing\n", sysname, total_ms);
+        else if (nreaders && !opened_by)
+            fprintf(stderr, "kbinsert: %s (%s): node in %.1f ms, not opened by any of %d readers after %.1f ms, continuing\n",
+                    sysname, ev_node, (t_node - t0) / 1e6, nreaders, total_ms);
+        else if (opened_by)
+            fprintf(stderr, "kbinsert: %s (%s): ready in %.1f ms (node %.1f ms, opened by pid %d)\n",
+                    sysname, ev_node, total_ms, (t_node - t0) / 1e6, opened_by);
+        else
+            fprintf(stderr, "kbinsert: %s (%s): ready in %.1f ms (no userspace input readers)\n",
+                    sysname, ev_node, total_ms);
+    }
+}
+
+// Initialize the uinput device with exactly the given keys enabled
+static int setup_uinput(struct kbi_ctx *ctx, const struct kbi_keys *keys) {
+    struct kbi_prof *pr = ctx->prof;
+    int prev = kbi_prof_phase(pr, KBI_PH_SETUP);
+    ctx->fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (ctx->fd < 0) {
+        perror("open /dev/uinput");
+        kbi_prof_phase(pr, prev);
+        return -1;
+    }
+
+    // Enable key events
+    prof_count(pr, KBI_SYS_IOCTL);
+    if (ioctl(ctx->fd, UI_SET_EVBIT, EV_KEY) < 0) {
+        perror("UI_SET_EVBIT");
+        close(ctx->fd);
+        ctx->fd = -1;
+        kbi_prof_phase(pr, prev);
+        return -1;
+    }
+
+    int nkeys = 0;
+    for (int code = 1; code < KEY_CNT; code++) {
+        if (!kbi_keys_has(keys, code)) continue;
+        ioctl(ctx->fd, UI_SET_KEYBIT, code);
+        nkeys++;
+    }
+    if (pr) pr->calls[KBI_SYS_IOCTL] += nkeys + 3;      // + SETUP, CREATE, GET_SYSNAME
+    ctx->dev_keys = *keys;
+    if (ctx->report_ready) fprintf(stderr, "kbinsert: registered %d keys\n", nkeys);
+
+    // Create device
+    struct uinput_setup usetup = {0};
+    snprintf(usetup.name, UINPUT_MAX_NAME_SIZE, "%s", ctx->name);
+    usetup.id.bustype = BUS_USB;
+    usetup.id.vendor  = 0x1234;
+    usetup.id.product = 0x5678;
+    ioctl(ctx->fd, UI_DEV_SETUP, &usetup);
+    ioctl(ctx->fd, UI_DEV_CREATE, NULL);
+    kbi_prof_phase(pr, KBI_PH_READY);
+    wait_for_device(ctx);
+    kbi_prof_phase(pr, prev);
+    return 0;
+}
+
+/* Pacing engine (modes in kbinsert.h). Adaptive mode reads back the
+ * consumer tty's input queue (FIONREAD) to see how many typed characters
+ * actually arrived. Characters that never show up count as drops and
+ * halve the rate.
+ */
+static const char *pace_names[] = { "fixed", "burst", "adaptive" };
+
+const char *kbi_pace_name(int mode) {
+    return (unsigned)mode <= KBI_PACE_ADAPTIVE ? pace_names[mode] : "?";
+}
+
+int kbi_parse_pace(const char *arg, struct kbi_pace *ps) {
+    char name[16] = "";
+    double a = 0, b = 0;
+    int n = sscanf(arg, "%15[a-z]:%lf:%lf", name, &a, &b);
+    if (n == 0) {                                   // bare number: fixed rate
+        n = sscanf(arg, "%lf", &a) == 1 ? 2 : 0;
+        strcpy(name, "fixed");
+    }
+    if (strcmp(name, "fixed") == 0 && n >= 2 && a > 0) {
+        *ps = (struct kbi_pace){ KBI_PACE_FIXED, a, 1, a };
+    } else if (strcmp(name, "burst") == 0 && n >= 2 && a > 0) {
+        *ps = (struct kbi_pace){ KBI_PACE_BURST, a, n == 3 && b >= 1 ? b : 32, a };
+    } else if (strcmp(name, "adaptive") == 0) {
+        double start = n >= 2 && a > 0 ? a : 200;
+        double max = n == 3 && b >= start ? b : 5000;
+        *ps = (struct kbi_pace){ KBI_PACE_ADAPTIVE, start, 1, max };
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void sleep_ns(struct pacer *p, long long ns) {
+    struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+    int prev = kbi_prof_phase(p->prof, KBI_PH_SLEEP);
+    p->st.syscalls++;
+    prof_count(p->prof, KBI_SYS_SLEEP);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        p->st.syscalls++;
+        prof_count(p->prof, KBI_SYS_SLEEP);
+    }
+    kbi_prof_phase(p->prof, prev);
+}
+
+/* Sleep until the absolute time due (CLOCK_MONOTONIC): unlike a relative
+ * sleep, time lost between computing the deadline and sleeping, or to
+ * signals, doesn't push the wakeup back.
+ */
+static void sleep_until(struct pacer *p, long long due) {
+    struct timespec ts = { due / 1000000000LL, due % 1000000000LL };
+    int prev = kbi_prof_phase(p->prof, KBI_PH_SLEEP);
+    do {
+        p->st.syscalls++;
+        prof_count(p->prof, KBI_SYS_SLEEP);
+    } while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    kbi_prof_phase(p->prof, prev);
+}
+
+static unsigned jit_bucket(long long us) {
+    if (us < 64) return us;
+    int e = 63 - __builtin_clzll(us);
+    if (e > 35) return JIT_BUCKETS - 1;
+    return 64 + (e - 6) * 32 + ((us >> (e - 5)) & 31);
+}
+
+// Smallest error in bucket b (the largest in b - 1), in ns
+static long long jit_value(unsigned b) {
+    if (b < 64) return b * 1000LL;
+    unsigned e = 6 + (b - 64) / 32;
+    return ((long long)(32 + (b - 64) % 32) << (e - 5)) * 1000;
+}
+
+// A batch of n characters went out at sent
+static void jitter_record(struct pacer *p, long long sent, int n) {
+    if (p->spec.mode != KBI_PACE_FIXED) return;
+    if (p->sent_ns) {
+        long long err = sent - p->sent_ns - (long long)(n * 1e9 / p->rate);
+        if (err < 0) err = -err;
+        p->jit[jit_bucket(err / 1000)]++;
+        p->st.intervals++;
+        if (err > p->st.jitter_max_ns) p->st.jitter_max_ns = err;
+    }
+    p->sent_ns = sent;
+}
+
+static void jitter_percentiles(struct pacer *p) {
+    struct { double q; long long *out; } pc[] = {
+        { 0.50, &p->st.jitter_p50_ns }, { 0.99, &p->st.jitter_p99_ns }, { 0.999, &p->st.jitter_p999_ns },
+    };
+    long long seen = 0;
+    unsigned b = 0;
+    for (size_t i = 0; i < sizeof(pc) / sizeof(pc[0]) && p->st.intervals; i++) {
+        long long rank = (long long)(pc[i].q * p->st.intervals + 0.999999);
+        while (b < JIT_BUCKETS && seen + p->jit[b] < rank) seen += p->jit[b++];
+        long long v = jit_value(b + 1);
+        *pc[i].out = v < p->st.jitter_max_ns ? v : p->st.jitter_max_ns;
+    }
+}
+
+// tty_fd is only used by adaptive mode; it is switched to non-canonical
+// input so FIONREAD counts partial lines, and restored by pacer_finish()
+static void pacer_start(struct pacer *p, const struct kbi_pace *spec, int tty_fd) {
+    memset(p, 0, sizeof(*p));
+    p->spec = *spec;
+    p->rate = spec->rate;
+    p->tokens = spec->burst;
+    p->start_ns = p->last_ns = now_ns();
+    p->tty_fd = -1;
+    p->st.mode = spec->mode;
+    p->st.start_rate = p->st.min_rate = spec->rate;
+    if (spec->mode != KBI_PACE_ADAPTIVE || tty_fd < 0) return;
+    if (tcgetattr(tty_fd, &p->saved_tio) < 0) {
+        p->st.blind = 1;
+        return;
+    }
+    p->tio = p->saved_tio;
+    p->tio.c_lflag &= ~ICANON;
+    p->tio.c_cc[VMIN] = 1;
+    p->tio.c_cc[VTIME] = 0;
+    if (tcsetattr(tty_fd, TCSANOW, &p->tio) < 0 || ioctl(tty_fd, FIONREAD, &p->base_inq) < 0) {
+        p->st.blind = 1;
+        return;
+    }
+    p->have_tio = 1;
+    p->tty_fd = tty_fd;
+}
+
+// Record a typed character that should land in the consumer tty's queue
+static void pacer_count(struct pacer *p, unsigned char c) {
+    if (!p) return;
+    if (p->recording) {
+        // The tty it will play into is unknown: leave out what a tty with
+        // the usual settings keeps to itself (^C ^\ ^Z, ^Q ^S)
+        if (c != 003 && c != 034 && c != 032 && c != 021 && c != 023) p->recorded++;
+        return;
+    }
+    if (p->tty_fd < 0) return;
+    const struct termios *t = &p->tio;
+    if ((t->c_lflag & ISIG) && (c == t->c_cc[VINTR] || c == t->c_cc[VQUIT] || c == t->c_cc[VSUSP]))
+        return;
+    if ((t->c_iflag & IXON) && (c == t->c_cc[VSTART] || c == t->c_cc[VSTOP]))
+        return;
+    if (c == '\r' && (t->c_iflag & IGNCR))
+        return;
+    p->expected++;
+}
+
+// Adaptive control: compare what we typed with what reached the tty
+static void pacer_feedback(struct pacer *p) {
+    int inq;
+    prof_count(p->prof, KBI_SYS_IOCTL);
+    if (ioctl(p->tty_fd, FIONREAD, &inq) < 0) return;
+    if (inq > p->base_inq) p->seen = 1;
+    long long backlog = p->expected - (inq - p->base_inq);
+    double window = p->rate * 0.02 > 8 ? p->rate * 0.02 : 8;   // 20 ms worth
+    if (backlog <= 0) {
+        if (++p->streak >= 16) {
+            p->rate = p->rate * 1.25 < p->spec.max_rate ? p->rate * 1.25 : p->spec.max_rate;
+            p->streak = 0;
+        }
+        return;
+    }
+    if (backlog <= window) return;
+
+    // Consumer is behind: give it up to 250 ms to catch up
+    p->st.stalls++;
+    p->streak = 0;
+    long long t0 = now_ns();
+    while (backlog > 0 && now_ns() - t0 < 250000000LL) {
+        sleep_ns(p, 1000000);
+        prof_count(p->prof, KBI_SYS_IOCTL);
+        if (ioctl(p->tty_fd, FIONREAD, &inq) < 0) return;
+        backlog = p->expected - (inq - p->base_inq);
+    }
+    p->st.slept_ns += now_ns() - t0;
+    if (inq > p->base_inq) p->seen = 1;
+    if (backlog > 0 && !p->seen) {
+        // Nothing ever arrived: the keystrokes go somewhere else (another
+        // window, a reading process). Stop adapting and hold the rate.
+        p->st.blind = 1;
+        p->tty_fd = -1;
+        return;
+    }
+    if (backlog > 0) {
+        p->st.drops += backlog;
+        p->expected -= backlog;
+        p->rate *= 0.5;
+    } else {
+        p->rate *= 0.75;
+    }
+    if (p->rate < 10) p->rate = 10;
+    if (p->rate < p->st.min_rate) p->st.min_rate = p->rate;
+}
+
+// Charge n characters to the token bucket and return when they may be
+// sent (CLOCK_MONOTONIC ns). While sends are owed the bucket's clock runs
+// ahead of now, so batches queued without sleeping are still spaced out.
+static long long pacer_due(struct pacer *p, int n) {
+    long long now = now_ns();
+    if (now > p->last_ns) {
+        p->tokens += (now - p->last_ns) * p->rate / 1e9;
+        if (p->tokens > p->spec.burst) p->tokens = p->spec.burst;
+        p->last_ns = now;
+    }
+    p->tokens -= n;
+    if (p->tokens < 0) {
+        long long ns = (long long)(-p->tokens * 1e9 / p->rate);
+        p->st.slept_ns += ns;
+        p->last_ns += ns;
+        p->tokens = 0;
+    }
+    p->st.chars += n;
+    return p->last_ns;
+}
+
+// Block until n more characters may be sent
+static void pacer_wait(struct pacer *p, int n) {
+    if (p->tty_fd >= 0) pacer_feedback(p);
+    long long due = pacer_due(p, n);
+    if (due > now_ns()) sleep_until(p, due);
+    jitter_record(p, now_ns(), n);
+}
+
+static void pacer_finish(struct pacer *p, int tty_fd) {
+    // Whatever is still missing after a short grace period was dropped
+    int inq;
+    long long t0 = now_ns();
+    while (p->tty_fd >= 0 && ioctl(p->tty_fd, FIONREAD, &inq) == 0) {
+        long long backlog = p->expected - (inq - p->base_inq);
+        if (backlog <= 0 || now_ns() - t0 > 100000000LL) {
+            if (backlog > 0 && (p->seen || inq > p->base_inq)) p->st.drops += backlog;
+            break;
+        }
+        sleep_ns(p, 1000000);
+    }
+    if (p->have_tio) tcsetattr(tty_fd, TCSANOW, &p->saved_tio);
+    p->st.elapsed_ns = now_ns() - p->start_ns;
+    p->st.end_rate = p->rate;
+    jitter_percentiles(p);
+}
+
+// Reap completions; timed: they are just in, so now is when they happened
+static void async_reap(struct kbi_ctx *ctx, int timed) {
+    struct async_engine *a = ctx->async;
+    struct io_uring_cqe cqe;
+    while (uring_cqe(&a->ring, &cqe) == 0) {
+        a->inflight--;
+        // Writes carry 1 + their arena slot in user_data; timeouts carry 0 and end in -ETIME
+        if (!cqe.user_data) continue;
+        const struct arena *ar = &a->arena[(cqe.user_data - 1) / ARENA_BATCHES];
+        unsigned i = (cqe.user_data - 1) % ARENA_BATCHES;
+        if (cqe.res != (int)(ar->batch[i].len * sizeof(*ar->ev)) && !a->error) {
+            a->error = cqe.res < 0 ? cqe.res : -EIO;
+            if (a->error != -ECANCELED)
+                fprintf(stderr, "kbinsert: io_uring write: %s\n", strerror(-a->error));
+        }
+        if (!ar->batch[i].chars) continue;
+        if (timed) jitter_record(&ctx->pace, now_ns(), ar->batch[i].chars);
+        else ctx->pace.sent_ns = 0;         // done while we weren't looking
+    }
+}
+
+/* Wait for the submitted chain to finish. With a profile attached (-s)
+ * each write is waited for on its own, so its completion time is known
+ * for the jitter stats; that costs an io_uring_enter() per key.
+ */
+static void async_wait(struct kbi_ctx *ctx) {
+    struct async_engine *a = ctx->async;
+    int timed = ctx->prof != NULL;
+    async_reap(ctx, 0);
+    // Waiting here is mostly the kernel running our pacing timeouts
+    int prev = a->inflight ? kbi_prof_phase(ctx->prof, KBI_PH_SLEEP) : -1;
+    while (a->inflight) {
+        ctx->pace.st.syscalls++;
+        prof_count(ctx->prof, KBI_SYS_URING);
+        if (uring_submit(&a->ring, timed ? 1 : a->inflight) < 0) {
+            perror("io_uring_enter");
+            a->error = -errno;
+            a->inflight = 0;
+            break;
+        }
+        async_reap(ctx, timed);
+    }
+    if (prev >= 0) kbi_prof_phase(ctx->prof, prev);
+}
+
+// Submit the arena being filled as one chain, once the previous chain is done
+static int async_submit(struct kbi_ctx *ctx) {
+    struct async_engine *a = ctx->async;
+    struct arena *ar = &a->arena[a->cur];
+    if (!ar->nbatch) return a->error ? -1 : 0;
+    async_wait(ctx);
+    long long now = now_ns();
+    struct io_uring_sqe *sqe = NULL;
+    for (unsigned i = 0; i < ar->nbatch; i++) {
+        if (ar->batch[i].due > now + URING_SLACK_NS) {
+            ar->ts[i].tv_sec = ar->batch[i].due / 1000000000LL;
+            ar->ts[i].tv_nsec = ar->batch[i].due % 1000000000LL;
+            sqe = uring_sqe(&a->ring);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (unsigned long)&ar->ts[i];
+            sqe->len = 1;
+            sqe->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+            sqe->flags = IOSQE_IO_LINK;
+            a->inflight++;
+        }
+        sqe = uring_sqe(&a->ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = ctx->fd;
+        sqe->addr = (unsigned long)(ar->ev + ar->batch[i].off);
+        sqe->len = ar->batch[i].len * sizeof(*ar->ev);
+        sqe->off = (__u64)-1;
+        sqe->user_data = 1 + a->cur * ARENA_BATCHES + i;
+        sqe->flags = IOSQE_IO_LINK;
+        a->inflight++;
+    }
+    sqe->flags = 0;             // end of the chain
+    ctx->pace.st.syscalls++;
+    int prev = kbi_prof_phase(ctx->prof, KBI_PH_WRITE);
+    prof_count(ctx->prof, KBI_SYS_URING);
+    if (ctx->prof) ctx->prof->bytes += ar->nev * sizeof(*ar->ev);
+    if (uring_submit(&a->ring, 0) < 0) {
+        perror("io_uring_enter");
+        a->error = -errno;
+        a->inflight = 0;
+    }
+    kbi_prof_phase(ctx->prof, prev);
+    a->cur ^= 1;
+    a->arena[a->cur].nbatch = 0;
+    a->arena[a->cur].nev = 0;
+    return a->error ? -1 : 0;
+}
+
+// Queue events for chars characters as one batch to be written at due
+// (0: right after the previous one). Batches longer than an arena are split.
+static int async_queue(struct kbi_ctx *ctx, const struct input_event *ev, size_t nev, int chars, long long due) {
+    struct async_engine *a = ctx->async;
+    if (ctx->hook && nev) ctx->hook(ctx->hook_arg, ev, nev);
+    while (nev > 0) {
+        struct arena *ar = &a->arena[a->cur];
+        if (ar->nbatch == ARENA_BATCHES || ar->nev == ARENA_EVENTS) {
+            async_submit(ctx);
+            continue;
+        }
+        size_t n = ARENA_EVENTS - ar->nev < nev ? ARENA_EVENTS - ar->nev : nev;
+        memcpy(ar->ev + ar->nev, ev, n * sizeof(*ev));
+        ar->batch[ar->nbatch].off = ar->nev;
+        ar->batch[ar->nbatch].len = n;
+        ar->batch[ar->nbatch].due = due;
+        ar->batch[ar->nbatch].chars = chars;
+        ar->nbatch++;
+        ar->nev += n;
+        ev += n;
+        nev -= n;
+        due = 0;
+        chars = 0;
+    }
+    return a->error ? -1 : 0;
+}
+
+// Write everything queued and wait for it
+static int async_drain(struct kbi_ctx *ctx) {
+    if (!ctx->async_on) return 0;
+    async_submit(ctx);
+    async_wait(ctx);
+    return ctx->async->error ? -1 : 0;
+}
+
+static void futex_wait(uint32_t *addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// The emitter: pace and write batches as they come, until told to stop
+static void *pipe_emitter(void *arg) {
+    struct kbi_ctx *ctx = arg;
+    struct pipeline *pl = ctx->pipe;
+    uint32_t tail = 0;
+    for (;;) {
+        if (__atomic_load_n(&pl->head, __ATOMIC_ACQUIRE) == tail) {
+            if (__atomic_load_n(&pl->stop, __ATOMIC_RELAXED)) break;
+            __atomic_store_n(&pl->cons_waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&pl->head, __ATOMIC_SEQ_CST) == tail) futex_wait(&pl->head, tail);
+            __atomic_store_n(&pl->cons_waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        const struct pipe_batch *b = &pl->batch[tail % PIPE_BATCHES];
+        if (b->chars) pacer_wait(&ctx->pace, b->chars);
+        if (b->nev && write_events(ctx, pl->ev + b->off, b->nev) < 0)
+            __atomic_store_n(&pl->error, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pl->tail, ++tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pl->prod_waiting, __ATOMIC_SEQ_CST)) futex_wake(&pl->tail);
+    }
+    return NULL;
+}
+
+// Where nev more events fit without overwriting unwritten ones (*off), if
+// there is room for them and their batch
+static int pipe_room(struct pipeline *pl, size_t nev, unsigned *off) {
+    uint32_t tail = __atomic_load_n(&pl->tail, __ATOMIC_SEQ_CST);
+    unsigned p = pl->ev_head;
+    if (pl->head == tail) {
+        *off = 0;
+        return 1;
+    }
+    if (pl->head - tail == PIPE_BATCHES) return 0;
+    unsigned oldest = pl->batch[tail % PIPE_BATCHES].off;
+    if (p >= oldest && p + nev <= PIPE_EVENTS) *off = p;
+    else if (p >= oldest && nev < oldest) *off = 0;
+    else if (p < oldest && p + nev < oldest) *off = p;
+    else return 0;
+    return 1;
+}
+
+// Sleep until the emitter has written another batch
+static void pipe_wait(struct pipeline *pl, uint32_t tail) {
+    __atomic_store_n(&pl->prod_waiting, 1, __ATOMIC_SEQ_CST);
+    futex_wait(&pl->tail, tail);
+    __atomic_store_n(&pl->prod_waiting, 0, __ATOMIC_RELAXED);
+}
+
+/* Add the emitter's syscalls, bytes and write latencies to the caller's
+ * profile (and clear them). Its phase times aren't added: it runs
+ * alongside the caller, whose own phases already cover the wall time.
+ */
+static void prof_merge(struct kbi_prof *to, struct kbi_prof *from) {
+    for (int i = 0; i < KBI_SYS_COUNT; i++) to->calls[i] += from->calls[i];
+    for (int i = 0; i < KBI_HIST; i++) to->hist[i] += from->hist[i];
+    to->bytes += from->bytes;
+    kbi_prof_start(from);
+}
+
+// Wait until the emitter has written everything queued
+static int pipe_drain(struct kbi_ctx *ctx) {
+    struct pipeline *pl = ctx->pipe;
+    uint32_t tail;
+    if (!ctx->pipe_on) return 0;
+    int prev = kbi_prof_phase(ctx->prof, KBI_PH_SLEEP);
+    while ((tail = __atomic_load_n(&pl->tail, __ATOMIC_SEQ_CST)) != pl->head)
+        pipe_wait(pl, tail);
+    kbi_prof_phase(ctx->prof, prev);
+    if (ctx->prof) prof_merge(ctx->prof, &pl->prof);
+    return __atomic_load_n(&pl->error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+// Queue events as one batch, to be written once chars more characters
+// may be sent. Blocks while the ring is full.
+static int pipe_push(struct kbi_ctx *ctx, const struct input_event *ev, size_t nev, unsigned chars) {
+    struct pipeline *pl = ctx->pipe;
+    unsigned off;
+    if (nev > PIPE_EVENTS / 2) {
+        // Too big to queue (a loaded macro's batch): write it from here
+        // while the emitter is idle
+        if (pipe_drain(ctx) < 0) return -1;
+        if (chars) pacer_wait(&ctx->pace, chars);
+        return write_events(ctx, ev, nev);
+    }
+    int prev = -1;
+    while (!pipe_room(pl, nev, &off)) {
+        uint32_t tail = __atomic_load_n(&pl->tail, __ATOMIC_SEQ_CST);
+        if (prev < 0) prev = kbi_prof_phase(ctx->prof, KBI_PH_SLEEP);
+        if (!pipe_room(pl, nev, &off)) pipe_wait(pl, tail);
+        else break;
+    }
+    if (prev >= 0) kbi_prof_phase(ctx->prof, prev);
+    if (nev) memcpy(pl->ev + off, ev, nev * sizeof(*ev));
+    pl->batch[pl->head % PIPE_BATCHES] = (struct pipe_batch){ off, nev, chars };
+    pl->ev_head = off + nev;
+    __atomic_store_n(&pl->head, pl->head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pl->cons_waiting, __ATOMIC_SEQ_CST)) futex_wake(&pl->head);
+    return __atomic_load_n(&pl->error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+static int pipe_start(struct kbi_ctx *ctx) {
+    struct pipeline *pl = calloc(1, sizeof(*pl));
+    if (!pl) {
+        perror("kbi_set_engine");
+        return -1;
+    }
+    ctx->pipe = pl;
+    if ((errno = pthread_create(&pl->thread, NULL, pipe_emitter, ctx)) != 0) {
+        perror("kbi_set_engine: pthread_create");
+        ctx->pipe = NULL;
+        free(pl);
+        return -1;
+    }
+    // A real-time caller (kbinsert --rt) would otherwise keep the emitter,
+    // which inherited its priority, off the CPU until it blocks
+    int policy;
+    struct sched_param sp;
+    if (pthread_getschedparam(pthread_self(), &policy, &sp) == 0 && policy != SCHED_OTHER
+        && sp.sched_priority < sched_get_priority_max(policy)) {
+        sp.sched_priority++;
+        pthread_setschedparam(pl->thread, policy, &sp);
+    }
+    return 0;
+}
+
+// Stop the (idle) emitter: an empty batch wakes it to see the flag
+static void pipe_stop(struct kbi_ctx *ctx) {
+    struct pipeline *pl = ctx->pipe;
+    __atomic_store_n(&pl->stop, 1, __ATOMIC_RELAXED);
+    pipe_push(ctx, NULL, 0, 0);
+    pthread_join(pl->thread, NULL);
+    free(pl);
+    ctx->pipe = NULL;
+    ctx->pipe_on = 0;
+}
+
+// End of a batch of n characters: pace it and send it
+static int send_batch(struct kbi_ctx *ctx, struct pacer *pace, int n) {
+    if (ctx->record) {
+        pace->st.chars += n;
+        return record_batch(ctx, n);
+    }
+    if (ctx->async_on) {
+        int ret = async_queue(ctx, ctx->evbuf, ctx->evlen, n, pacer_due(pace, n));
+        ctx->evlen = 0;
+        return ret;
+    }
+    if (ctx->pipe_on) {
+        int ret = pipe_push(ctx, ctx->evbuf, ctx->evlen, n);
+        ctx->evlen = 0;
+        return ret;
+    }
+    pacer_wait(pace, n);
+    return flush_events(ctx);
+}
+
+/* Modifiers stay held across consecutive strokes that need them, so
+ * "HELLO" is one Shift press around five keys rather than five. Only
+ * transitions emit modifier events; release_mods() lets go at the end.
+ */
+static void set_mods(struct kbi_ctx *ctx, int mods, int ctrl_key) {
+    int drop = ctx->held_mods & ~mods, add = mods & ~ctx->held_mods;
+    int altgr = ctx->layout.altgr_code;
+    if (drop & MOD_SHIFT) { emit(ctx, EV_KEY, KEY_LEFTSHIFT, 0); emit(ctx, EV_SYN, SYN_REPORT, 0); }
+    if (drop & MOD_ALTGR) { emit(ctx, EV_KEY, altgr, 0); emit(ctx, EV_SYN, SYN_REPORT, 0); }
+    if (drop & MOD_CTRL)  { emit(ctx, EV_KEY, ctx->held_ctrl, 0); emit(ctx, EV_SYN, SYN_REPORT, 0); }
+    if (add & MOD_CTRL)   { emit(ctx, EV_KEY, ctrl_key, 1); emit(ctx, EV_SYN, SYN_REPORT, 0); ctx->held_ctrl = ctrl_key; }
+    if (add & MOD_ALTGR)  { emit(ctx, EV_KEY, altgr, 1); emit(ctx, EV_SYN, SYN_REPORT, 0); }
+    if (add & MOD_SHIFT)  { emit(ctx, EV_KEY, KEY_LEFTSHIFT, 1); emit(ctx, EV_SYN, SYN_REPORT, 0); }
+    ctx->held_mods = mods;
+}
+
+static void release_mods(struct kbi_ctx *ctx) {
+    set_mods(ctx, 0, 0);
+}
+
+// Press and release one key with the given modifiers held
+static void emit_stroke(struct kbi_ctx *ctx, int code, int mods, int ctrl_key) {
+    if (ctx->collect) {
+        // Dry run: record the keys without touching the held state
+        if (mods & MOD_CTRL)  emit(ctx, EV_KEY, ctrl_key, 1);
+        if (mods & MOD_ALTGR) emit(ctx, EV_KEY, ctx->layout.altgr_code, 1);
+        if (mods & MOD_SHIFT) emit(ctx, EV_KEY, KEY_LEFTSHIFT, 1);
+        emit(ctx, EV_KEY, code, 1);
+        return;
+    }
+    if ((ctx->held_mods & MOD_CTRL) && ctx->held_ctrl != ctrl_key)
+        set_mods(ctx, ctx->held_mods & ~MOD_CTRL, ctrl_key);
+    set_mods(ctx, mods, ctrl_key);
+    emit(ctx, EV_KEY, code, 1); emit(ctx, EV_SYN, SYN_REPORT, 0);
+    emit(ctx, EV_KEY, code, 0); emit(ctx, EV_SYN, SYN_REPORT, 0);
+}
+
+// The layout's keystrokes for cp, or NULL; text tends to repeat a few
+// characters, so the binary search runs once per codepoint seen
+static const struct layout_entry *cp_lookup(struct kbi_ctx *ctx, uint32_t cp) {
+    if (!ctx->layout.count) return NULL;
+    unsigned slot = cp % CP_CACHE;
+    if (ctx->cp_cache[slot].cp != cp) {
+        ctx->cp_cache[slot].cp = cp;
+        ctx->cp_cache[slot].e = layout_lookup(&ctx->layout, cp);
+    }
+    return ctx->cp_cache[slot].e;
+}
+
+/* Unicode input as GTK and IBus take it: Ctrl+Shift+U, the codepoint in
+ * hex, Space. The keys come from the byte table, so this works on any
+ * layout that has a-f, 0-9 and u.
+ */
+static int emit_hex(struct kbi_ctx *ctx, uint32_t cp, int ctrl_key) {
+    const struct key_map *m = ctx->byte_map;
+    char hex[9];
+    int n = snprintf(hex, sizeof(hex), "%x", cp);
+    if (!m['u'].code || !m[' '].code) return 0;
+    for (int i = 0; i < n; i++)
+        if (!m[(unsigned char)hex[i]].code) return 0;
+    emit_stroke(ctx, m['u'].code, MOD_CTRL | MOD_SHIFT, ctrl_key);
+    for (int i = 0; i < n; i++)
+        emit_stroke(ctx, m[(unsigned char)hex[i]].code, m[(unsigned char)hex[i]].mods, ctrl_key);
+    emit_stroke(ctx, m[' '].code, m[' '].mods, ctrl_key);
+    return 1;
+}
+
+// Type cp from the layout, else (with KBI_UNICODE_HEX) as a hex sequence
+static int emit_layout(struct kbi_ctx *ctx, uint32_t cp, int ctrl_key) {
+    const struct layout_entry *e = cp_lookup(ctx, cp);
+    if (!e) return (ctx->flags & KBI_UNICODE_HEX) && cp >= 0x80 && emit_hex(ctx, cp, ctrl_key);
+    for (int k = 0; k < e->nkeys; k++)
+        emit_stroke(ctx, e->code[k], e->mods[k], ctrl_key);
+    return 1;
+}
+
+// Type a decoded string, flushing each batch with a single write().
+// ASCII goes through the byte table; other bytes are decoded as UTF-8
+// (sequences may span calls) and looked up in the layout, if any.
+static int inject_text(struct kbi_ctx *ctx, struct decoder *d, const char *text, size_t len) {
+    int pending = 0, ret = 0;
+    int prev = kbi_prof_phase(ctx->prof, KBI_PH_MAP);
+    int ctrl_key = ctx->flags & KBI_SWAP ? KEY_CAPSLOCK : KEY_LEFTCTRL;
+    struct pacer *pace = ctx->collect ? NULL : &ctx->pace;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        const struct key_map *k = &ctx->byte_map[c];
+        if (k->code) {
+            emit_stroke(ctx, k->code, k->mods, ctrl_key);
+            pacer_count(pace, c);
+        } else if (c < 0x80) {
+            if (emit_layout(ctx, c, ctrl_key)) pacer_count(pace, c);
+        } else {
+            if (c >= 0xc2 && c <= 0xf4) {               // lead byte
+                d->u8need = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+                d->u8cp = c & (0x3f >> d->u8need);
+                d->u8len = 1;
+                continue;
+            }
+            if (c >= 0xc0 || !d->u8need) {              // invalid or stray continuation
+                d->u8need = 0;
+                continue;
+            }
+            d->u8cp = d->u8cp << 6 | (c & 0x3f);
+            d->u8len++;
+            if (--d->u8need > 0) continue;
+            if (emit_layout(ctx, d->u8cp, ctrl_key))
+                for (int b = 0; b < d->u8len; b++) pacer_count(pace, 0x80);
+        }
+        if (!pace) continue;
+        pending++;
+        int end_of_batch = ctx->batch == KBI_BATCH_WORD
+            ? (isspace(c) || i + 1 == len)
+            : (pending >= ctx->batch || i + 1 == len);
+        if (end_of_batch) {
+            if (send_batch(ctx, pace, pending) < 0) ret = -1;
+            pending = 0;
+        }
+    }
+    if (pending && send_batch(ctx, pace, pending) < 0) ret = -1;
+    kbi_prof_phase(ctx->prof, prev);
+    return ret;
+}
+
+// Run one piece of raw text through the escape decoder into the injector
+static int feed(struct kbi_ctx *ctx, struct decoder *d, const char *buf, size_t len, int final) {
+    if (!(ctx->flags & KBI_ESCAPES))
+        return inject_text(ctx, d, buf, len);
+    int ret = 0, prev = kbi_prof_phase(ctx->prof, KBI_PH_DECODE);
+    do {
+        // Text between escapes is typed straight from the caller's buffer
+        if (d->esc.state == ESC_NONE) {
+            size_t run = escape_free(buf, len);
+            if (run) {
+                if (inject_text(ctx, d, buf, run) < 0) ret = -1;
+                buf += run;
+                len -= run;
+            }
+            if (!len && !final) break;
+        }
+        size_t n = len < ESC_WINDOW ? len : ESC_WINDOW;
+        size_t out = kbi_decode_escapes(&d->esc, buf, n, ctx->dec, final && n == len);
+        if (inject_text(ctx, d, ctx->dec, out) < 0) ret = -1;
+        buf += n;
+        len -= n;
+    } while (len > 0);
+    kbi_prof_phase(ctx->prof, prev);
+    return ret;
+}
+
+struct kbi_ctx *kbi_new(void) {
+    struct kbi_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        perror("kbi_new");
+        return NULL;
+    }
+    ctx->fd = ctx->vfd = -1;
+    ctx->ready_timeout_ms = 1000;
+    strcpy(ctx->name, "kinject-uinput");
+    ctx->byte_map = ascii_keymap;
+    cp_cache_clear(ctx);
+    kbi_begin(ctx, 0, KBI_BATCH_CHAR, NULL, -1);
+    return ctx;
+}
+
+void kbi_free(struct kbi_ctx *ctx) {
+    if (!ctx) return;
+    kbi_close(ctx);
+    kbi_set_engine(ctx, KBI_ENGINE_SYNC);
+    if (ctx->layout.count) layout_free(&ctx->layout);
+    free(ctx);
+}
+
+void kbi_set_profile(struct kbi_ctx *ctx, struct kbi_prof *prof) {
+    ctx->prof = prof;
+    ctx->pace.prof = prof;
+}
+
+void kbi_set_name(struct kbi_ctx *ctx, const char *name) {
+    snprintf(ctx->name, sizeof(ctx->name), "%s", name);
+}
+
+int kbi_set_engine(struct kbi_ctx *ctx, int engine) {
+    if (engine != KBI_ENGINE_URING && ctx->async) {
+        async_drain(ctx);
+        uring_free(&ctx->async->ring);
+        free(ctx->async);
+        ctx->async = NULL;
+        ctx->async_on = 0;
+    }
+    if (engine != KBI_ENGINE_THREAD && ctx->pipe) {
+        pipe_drain(ctx);
+        pipe_stop(ctx);
+    }
+    if (engine == KBI_ENGINE_SYNC) return 0;
+    if (engine == KBI_ENGINE_THREAD) return ctx->pipe ? 0 : pipe_start(ctx);
+    if (ctx->async) return 0;
+    struct async_engine *a = calloc(1, sizeof(*a));
+    if (!a) {
+        perror("kbi_set_engine");
+        return -1;
+    }
+    if (uring_init(&a->ring, URING_DEPTH) < 0) {
+        fprintf(stderr, "kbinsert: io_uring unavailable (%s), using write()\n", strerror(errno));
+        free(a);
+        return -1;
+    }
+    ctx->async = a;
+    return 0;
+}
+
+void kbi_set_verify(struct kbi_ctx *ctx, int on) {
+    ctx->verify = on;
+    if (!on && ctx->vfd >= 0) {
+        close(ctx->vfd);
+        ctx->vfd = -1;
+    }
+}
+
+// Open the node to read back (once per device), and drop what earlier
+// texts left in it
+static int verify_open(struct kbi_ctx *ctx) {
+    struct input_event junk[64];
+    if (!ctx->verify || ctx->record || ctx->fd < 0) return 0;
+    if (ctx->vfd < 0) {
+        if (!ctx->ev_node[0]) {
+            fprintf(stderr, "kbinsert: can't verify: no event node found for %s\n", ctx->name);
+            return -1;
+        }
+        if ((ctx->vfd = open(ctx->ev_node, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+            perror(ctx->ev_node);
+            return -1;
+        }
+    }
+    while (read(ctx->vfd, junk, sizeof(junk)) > 0)
+        ;
+    return 0;
+}
+
+void kbi_set_ready(struct kbi_ctx *ctx, int timeout_ms, int report) {
+    ctx->ready_timeout_ms = timeout_ms < 0 ? 0 : timeout_ms;
+    ctx->report_ready = report;
+}
+
+void kbi_set_flush_hook(struct kbi_ctx *ctx,
+                        void (*fn)(void *arg, const struct input_event *ev, size_t n), void *arg) {
+    ctx->hook = fn;
+    ctx->hook_arg = arg;
+}
+
+static void keys_add_mods(const struct kbi_ctx *ctx, struct kbi_keys *ks, int mods) {
+    if (mods & MOD_SHIFT) kbi_keys_add(ks, KEY_LEFTSHIFT);
+    if (mods & MOD_CTRL) {
+        kbi_keys_add(ks, KEY_LEFTCTRL);
+        kbi_keys_add(ks, KEY_CAPSLOCK);
+    }
+    if (mods & MOD_ALTGR) kbi_keys_add(ks, ctx->layout.altgr_code);
+}
+
+void kbi_all_keys(const struct kbi_ctx *ctx, struct kbi_keys *ks) {
+    memset(ks, 0, sizeof(*ks));
+    for (int c = 0; c < 256; c++) {
+        if (!ctx->byte_map[c].code) continue;
+        kbi_keys_add(ks, ctx->byte_map[c].code);
+        keys_add_mods(ctx, ks, ctx->byte_map[c].mods);
+    }
+    for (uint32_t i = 0; i < ctx->layout.count; i++)
+        for (int k = 0; k < ctx->layout.entries[i].nkeys; k++) {
+            kbi_keys_add(ks, ctx->layout.entries[i].code[k]);
+            keys_add_mods(ctx, ks, ctx->layout.entries[i].mods[k]);
+        }
+}
+
+int kbi_open(struct kbi_ctx *ctx, const struct kbi_keys *keys) {
+    struct kbi_keys want;
+    int held = 0, held_ctrl = 0;
+    if (keys) want = *keys;
+    else kbi_all_keys(ctx, &want);
+    if (ctx->fd >= 0) {
+        if (kbi_keys_covers(&ctx->dev_keys, &want)) return 0;
+        kbi_keys_union(&want, &ctx->dev_keys);
+        held = ctx->held_mods;
+        held_ctrl = ctx->held_ctrl;
+        kbi_close(ctx);
+    }
+    if (setup_uinput(ctx, &want) < 0) return -1;
+    // Replaced in the middle of a text: read back from the new node, and
+    // hold again what the old device let go of
+    if (ctx->pacing) {
+        if (verify_open(ctx) < 0) return -1;
+        if (held) set_mods(ctx, held, held_ctrl);
+    }
+    return 1;
+}
+
+void kbi_close(struct kbi_ctx *ctx) {
+    if (ctx->fd < 0) return;
+    if (ctx->held_mods) release_mods(ctx);
+    flush_events(ctx);
+    async_drain(ctx);
+    pipe_drain(ctx);
+    ioctl(ctx->fd, UI_DEV_DESTROY);
+    close(ctx->fd);
+    ctx->fd = -1;
+    if (ctx->vfd >= 0) close(ctx->vfd);
+    ctx->vfd = -1;
+    ctx->held_mods = 0;     // a new device starts with nothing held
+    ctx->ev_node[0] = '\0';
+    memset(&ctx->dev_keys, 0, sizeof(ctx->dev_keys));
+}
+
+const char *kbi_event_node(const struct kbi_ctx *ctx) {
+    return ctx->ev_node;
+}
+
+const struct kbi_keys *kbi_device_keys(const struct kbi_ctx *ctx) {
+    return &ctx->dev_keys;
+}
+
+void kbi_begin(struct kbi_ctx *ctx, int flags, int batch, const struct kbi_pace *pace, int tty_fd) {
+    static const struct kbi_pace default_pace = { KBI_PACE_FIXED, 200, 1, 200 };
+    ctx->flags = flags;
+    ctx->batch = batch;
+    ctx->pace_spec = pace ? *pace : default_pace;
+    ctx->tty_fd = tty_fd;
+    ctx->pacing = 0;
+    if (ctx->async) ctx->async->error = 0;
+    if (ctx->pipe) ctx->pipe->error = 0;
+    memset(&ctx->text, 0, sizeof(ctx->text));
+    memset(&ctx->scan, 0, sizeof(ctx->scan));
+}
+
+static int start_text(struct kbi_ctx *ctx) {
+    if (ctx->pacing) return 0;
+    if (verify_open(ctx) < 0) return -1;
+    pacer_start(&ctx->pace, &ctx->pace_spec, ctx->record ? -1 : ctx->tty_fd);
+    ctx->pace.recording = ctx->record != NULL;
+    ctx->pacing = 1;
+    // Adaptive pacing and read-back need to look between batches
+    ctx->async_on = ctx->async && !ctx->record && !ctx->verify && ctx->pace_spec.mode != KBI_PACE_ADAPTIVE;
+    // The emitter does read-back itself; adaptive pacing counts characters
+    // as they are mapped, so it stays on this thread
+    ctx->pipe_on = ctx->pipe && !ctx->record && ctx->pace_spec.mode != KBI_PACE_ADAPTIVE;
+    // The emitter times its writes and sleeps in a profile of its own
+    if (ctx->pipe_on && ctx->prof) kbi_prof_start(&ctx->pipe->prof);
+    ctx->pace.prof = ctx->pipe_on && ctx->prof ? &ctx->pipe->prof : ctx->prof;
+    return 0;
+}
+
+int kbi_inject(struct kbi_ctx *ctx, const char *buf, size_t len) {
+    if (ctx->fd < 0 && !ctx->record && kbi_open(ctx, NULL) < 0) return -1;
+    if (start_text(ctx) < 0) return -1;
+    int ret = feed(ctx, &ctx->text, buf, len, 0);
+    // Leave this piece running while the caller prepares the next one
+    if (ctx->async_on && async_submit(ctx) < 0) ret = -1;
+    return ret;
+}
+
+int kbi_end(struct kbi_ctx *ctx, struct kbi_stats *stats) {
+    int ret = 0;
+    if ((ctx->fd >= 0 || ctx->record) && start_text(ctx) < 0) {
+        ret = -1;
+    } else if (ctx->fd >= 0 || ctx->record) {
+        if (feed(ctx, &ctx->text, NULL, 0, 1) < 0) ret = -1;
+        if (ctx->held_mods) release_mods(ctx);
+        if (flush_events(ctx) < 0) ret = -1;
+        if (async_drain(ctx) < 0 || pipe_drain(ctx) < 0) ret = -1;
+        pacer_finish(&ctx->pace, ctx->tty_fd);
+    }
+    if (stats) *stats = ctx->pace.st;
+    kbi_begin(ctx, ctx->flags, ctx->batch, &ctx->pace_spec, -1);
+    ctx->async_on = ctx->pipe_on = 0;
+    ctx->pace.prof = ctx->prof;
+    ctx->record = NULL;
+    return ret;
+}
+
+void kbi_record(struct kbi_ctx *ctx, struct kbi_script *s) {
+    memset(s, 0, sizeof(*s));
+    s->pace = ctx->pace_spec;
+    ctx->record = s;
+}
+
+int kbi_play(struct kbi_ctx *ctx, const struct kbi_script *s, struct kbi_stats *stats) {
+    int ret = 0;
+    if (kbi_open(ctx, &s->keys) < 0 || start_text(ctx) < 0) return -1;
+    const struct input_event *ev = s->ev;
+    for (size_t i = 0; i < s->nbatch; i++) {
+        const struct kbi_batch *b = &s->batch[i];
+        if (ctx->async_on) {
+            if (async_queue(ctx, ev, b->events, b->chars, b->chars ? pacer_due(&ctx->pace, b->chars) : 0) < 0)
+                ret = -1;
+        } else if (ctx->pipe_on) {
+            if (pipe_push(ctx, ev, b->events, b->chars) < 0) ret = -1;
+        } else {
+            // Adaptive pacing (never async or piped) checks these against the tty
+            if (ctx->pace.tty_fd >= 0) ctx->pace.expected += b->tty;
+            if (b->chars) pacer_wait(&ctx->pace, b->chars);
+            if (write_events(ctx, ev, b->events) < 0) ret = -1;
+        }
+        ev += b->events;
+    }
+    if (async_drain(ctx) < 0 || pipe_drain(ctx) < 0) ret = -1;
+    pacer_finish(&ctx->pace, ctx->tty_fd);
+    if (stats) *stats = ctx->pace.st;
+    kbi_begin(ctx, ctx->flags, ctx->batch, &ctx->pace_spec, -1);
+    ctx->async_on = ctx->pipe_on = 0;
+    ctx->pace.prof = ctx->prof;
+    return ret;
+}
+
+void kbi_script_free(struct kbi_script *s) {
+    if (s->map) {
+        munmap(s->map, s->map_len);
+    } else {
+        free(s->ev);
+        free(s->batch);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+/* Macro file: header, batches, events. The header records the event size
+ * so a file from another ABI (32-bit time_t) is rejected, not misread.
+ */
+#define MACRO_MAGIC "KBIMAC2"
+
+struct macro_hdr {
+    char magic[8];
+    uint32_t event_size, batch_size;
+    uint64_t nbatch, nev;
+    struct kbi_pace pace;
+    struct kbi_keys keys;
+};
+
+int kbi_script_save(const struct kbi_script *s, const char *path) {
+    char tmp[4200];
+    struct macro_hdr h = { MACRO_MAGIC, sizeof(*s->ev), sizeof(*s->batch),
+                           s->nbatch, s->nev, s->pace, s->keys };
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        perror(tmp);
+        return -1;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+          && fwrite(s->batch, sizeof(*s->batch), s->nbatch, f) == s->nbatch
+          && fwrite(s->ev, sizeof(*s->ev), s->nev, f) == s->nev;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) < 0) {
+        perror(path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Is the mapped script well formed? Every batch within bounds, and only
+// key events for declared keys, SYN_REPORTs, and values 0/1.
+static int script_valid(const struct kbi_script *s) {
+    size_t total = 0;
+    for (size_t i = 0; i < s->nbatch; i++) {
+        total += s->batch[i].events;
+        if (total > s->nev) return 0;
+    }
+    if (total != s->nev) return 0;
+    for (size_t i = 0; i < s->nev; i++) {
+        const struct input_event *ie = &s->ev[i];
+        if (ie->type == EV_SYN ? ie->code != SYN_REPORT
+            : ie->type != EV_KEY || ie->code >= KEY_CNT || !kbi_keys_has(&s->keys, ie->code)
+              || (unsigned)ie->value > 1)
+            return 0;
+    }
+    return 1;
+}
+
+int kbi_script_load(struct kbi_script *s, const char *path) {
+    struct stat st;
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void *map = (size_t)st.st_size >= sizeof(struct macro_hdr)
+        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const struct macro_hdr *h = map;
+    if (map == MAP_FAILED || memcmp(h->magic, MACRO_MAGIC, 8) != 0
+        || h->event_size != sizeof(*s->ev) || h->batch_size != sizeof(*s->batch)
+        || h->nbatch > (uint64_t)st.st_size / sizeof(*s->batch)
+        || h->nev > (uint64_t)st.st_size / sizeof(*s->ev)
+        || !(h->pace.rate > 0) || !(h->pace.burst >= 1) || (unsigned)h->pace.mode > KBI_PACE_ADAPTIVE
+        || (uint64_t)st.st_size != sizeof(*h) + h->nbatch * sizeof(*s->batch) + h->nev * sizeof(*s->ev)) {
+        fprintf(stderr, "kbinsert: %s: not a kbinsert macro file\n", path);
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        return -1;
+    }
+    s->batch = (struct kbi_batch *)(h + 1);
+    s->ev = (struct input_event *)(s->batch + h->nbatch);
+    s->nbatch = h->nbatch;
+    s->nev = h->nev;
+    s->pace = h->pace;
+    s->keys = h->keys;
+    s->map = map;
+    s->map_len = st.st_size;
+    if (!script_valid(s)) {
+        fprintf(stderr, "kbinsert: %s: corrupt macro file\n", path);
+        kbi_script_free(s);
+        return -1;
+    }
+    return 0;
+}
+
+void kbi_scan(struct kbi_ctx *ctx, const char *buf, size_t len, int final, struct kbi_keys *keys) {
+    // The dry run is all scan time, not decode and map
+    struct kbi_prof *pr = ctx->prof;
+    int prev = kbi_prof_phase(pr, KBI_PH_SCAN);
+    ctx->prof = NULL;
+    ctx->collect = keys;
+    feed(ctx, &ctx->scan, buf, len, final);
+    ctx->collect = NULL;
+    ctx->prof = pr;
+    kbi_prof_phase(pr, prev);
+    if (final) memset(&ctx->scan, 0, sizeof(ctx->scan));
+}
@@ -0,0 +1,218 @@
+/* queue.c — the cross-process turn queue (see queue.h)
+ *
+ * A ticket lock in a shared mapping: `next` hands out tickets, `serving`
+ * is the one whose turn it is, and waiters FUTEX_WAIT on `serving` (a
+ * shared futex, the mapping being the same page in every process). Each
+ * ticket's slot records the pid, and its start time against pid reuse, so
+ * a waiter can tell that the ticket being served belongs to a process
+ * that is gone and move the queue on.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "queue.h"
+
+#define QUEUE_SLOTS     256         // tickets outstanding at once
+#define QUEUE_CHECK_MS  100         // how often waiters look for a dead holder
+#define QUEUE_LOST_MS   10000       // a ticket no pid claimed is skipped after this
+
+struct queue_slot {
+    uint32_t ticket;                // published last: pid and start are valid
+    int pid;
+    unsigned long long start;
+};
+
+struct queue_shm {
+    uint32_t next, serving;
+    struct queue_slot slot[QUEUE_SLOTS];
+    // --queue-stats
+    long long served, contended, wait_ns, max_wait_ns, skipped;
+    unsigned max_ahead;
+};
+
+static struct queue_shm *q;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Map the queue (create: make it if there is none yet)
+static int queue_map(int create) {
+    char name[64];
+    struct stat st;
+    if (q) return 0;
+    snprintf(name, sizeof(name), "/kbinsert-%u.queue", (unsigned)geteuid());
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (fd < 0) {
+        if (create || errno != ENOENT) fprintf(stderr, "kbinsert: queue /dev/shm%s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    // Someone else's queue could hold us up forever
+    if (fstat(fd, &st) < 0 || st.st_uid != geteuid()) {
+        fprintf(stderr, "kbinsert: queue /dev/shm%s: not ours\n", name);
+        close(fd);
+        return -1;
+    }
+    // A new queue is all zeros, which is an empty one; racing creators
+    // both extending it is harmless
+    if (st.st_size < (off_t)sizeof(*q) && ftruncate(fd, sizeof(*q)) < 0) {
+        fprintf(stderr, "kbinsert: queue /dev/shm%s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    void *m = mmap(NULL, sizeof(*q), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        perror("kbinsert: queue mmap");
+        return -1;
+    }
+    q = m;
+    return 0;
+}
+
+// Start time of pid (clock ticks since boot); 0 if it is gone or a zombie
+static unsigned long long proc_start(int pid) {
+    char path[32], buf[512], state = 0;
+    unsigned long long start = 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    // Fields 3 to 21 lie between the command name and the start time
+    char *p = strrchr(buf, ')');
+    if (!p || sscanf(p + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                     &state, &start) != 2)
+        return 0;
+    return state == 'Z' || state == 'X' ? 0 : start;
+}
+
+static void futex_wake_all(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Ticket s is being served: if its process is gone, or took the ticket
+ * but died before saying who it is, serve the next one. lost and since
+ * track how long s has gone unclaimed. A ticket nobody has taken yet is
+ * never skipped, or serving would run ahead of next.
+ */
+static void check_holder(uint32_t s, uint32_t *lost, long long *since) {
+    const struct queue_slot *h = &q->slot[s % QUEUE_SLOTS];
+    int dead;
+    if ((int32_t)(__atomic_load_n(&q->next, __ATOMIC_SEQ_CST) - s) <= 0) return;
+    if (__atomic_load_n(&h->ticket, __ATOMIC_ACQUIRE) == s && h->pid > 0) {
+        dead = proc_start(h->pid) != h->start;
+    } else {
+        if (*lost != s) {
+            *lost = s;
+            *since = now_ns();
+        }
+        dead = now_ns() - *since > QUEUE_LOST_MS * 1000000LL;
+    }
+    if (dead && __atomic_compare_exchange_n(&q->serving, &s, s + 1, 0,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&q->skipped, 1, __ATOMIC_RELAXED);
+        futex_wake_all(&q->serving);
+    }
+}
+
+static void store_max(long long *max, long long v) {
+    long long cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(max, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+int queue_enter(struct queue_turn *turn) {
+    memset(turn, 0, sizeof(*turn));
+    if (queue_map(1) < 0) return -1;
+    long long t0 = now_ns();
+    struct timespec check = { 0, QUEUE_CHECK_MS * 1000000L };
+    uint32_t t, s;
+    do {
+        t = __atomic_fetch_add(&q->next, 1, __ATOMIC_SEQ_CST);
+        struct queue_slot *mine = &q->slot[t % QUEUE_SLOTS];
+        mine->pid = getpid();
+        mine->start = proc_start(mine->pid);
+        __atomic_store_n(&mine->ticket, t, __ATOMIC_RELEASE);
+
+        uint32_t lost = t;
+        long long since = 0;
+        turn->ticket = t;
+        turn->ahead = t - __atomic_load_n(&q->serving, __ATOMIC_SEQ_CST);
+        // Served past t: we were stopped or slow to claim it and were
+        // skipped as lost; take a new ticket
+        while ((int32_t)((s = __atomic_load_n(&q->serving, __ATOMIC_SEQ_CST)) - t) < 0) {
+            // Woken when serving changes; timing out means nobody moved on
+            if (syscall(SYS_futex, &q->serving, FUTEX_WAIT, s, &check, NULL, 0) < 0 && errno == ETIMEDOUT)
+                check_holder(s, &lost, &since);
+        }
+    } while (s != t);
+    turn->held = 1;
+    turn->wait_ns = now_ns() - t0;
+
+    __atomic_fetch_add(&q->served, 1, __ATOMIC_RELAXED);
+    if (turn->ahead) {
+        __atomic_fetch_add(&q->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&q->wait_ns, turn->wait_ns, __ATOMIC_RELAXED);
+        store_max(&q->max_wait_ns, turn->wait_ns);
+        unsigned cur = __atomic_load_n(&q->max_ahead, __ATOMIC_RELAXED);
+        while (turn->ahead > cur && !__atomic_compare_exchange_n(&q->max_ahead, &cur, turn->ahead, 1,
+                                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+    return 0;
+}
+
+void queue_leave(struct queue_turn *turn) {
+    uint32_t t = turn->ticket;
+    if (!turn->held) return;
+    turn->held = 0;
+    // (unless a waiter took us for dead and moved on already)
+    if (!__atomic_compare_exchange_n(&q->serving, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return;
+    // A waiter that came after this load sees the new serving before it sleeps
+    if (__atomic_load_n(&q->next, __ATOMIC_SEQ_CST) != turn->ticket + 1)
+        futex_wake_all(&q->serving);
+}
+
+int queue_print_stats(int json) {
+    if (queue_map(0) < 0) {
+        if (json) printf("{\"kbinsert\":\"queue\",\"served\":0}\n");
+        else printf("kbinsert queue: nothing typed since boot\n");
+        return 0;
+    }
+    uint32_t next = __atomic_load_n(&q->next, __ATOMIC_SEQ_CST);
+    uint32_t serving = __atomic_load_n(&q->serving, __ATOMIC_SEQ_CST);
+    const struct queue_slot *h = &q->slot[serving % QUEUE_SLOTS];
+    int holder = next != serving && h->ticket == serving && proc_start(h->pid) == h->start ? h->pid : 0;
+    unsigned waiting = next - serving - (next != serving);
+    long long served = q->served, contended = q->contended;
+    double avg = contended ? q->wait_ns / 1e9 / contended : 0;
+    if (json) {
+        printf("{\"kbinsert\":\"queue\",\"served\":%lld,\"contended\":%lld,\"wait_ns\":%lld,"
+               "\"max_wait_ns\":%lld,\"max_ahead\":%u,\"skipped\":%lld,\"holder\":%d,\"waiting\":%u}\n",
+               served, contended, q->wait_ns, q->max_wait_ns, q->max_ahead, q->skipped, holder, waiting);
+        return 0;
+    }
+    printf("kbinsert queue: %lld payloads, %lld waited (%.0f%%), up to %u ahead\n",
+           served, contended, served ? 100.0 * contended / served : 0.0, q->max_ahead);
+    printf("  wait: %.3f s total, %.3f s avg, %.3f s max\n", q->wait_ns / 1e9, avg, q->max_wait_ns / 1e9);
+    if (holder) printf("  now: pid %d typing, %u waiting\n", holder, waiting);
+    else printf("  now: idle\n");
+    if (q->skipped) printf("  %lld turns skipped (process gone)\n", q->skipped);
+    return 0;
+}
@@ -0,0 +1,30 @@
+/* queue.h — one payload at a time: the turn queue kbinsert processes share
+ *
+ * Concurrent kbinserts (and kbinsertd) of one user would otherwise type
+ * into the same focus at once, their keys interleaved. Before typing, each
+ * takes a ticket from a queue in shared memory (/dev/shm) and sleeps on a
+ * futex until its ticket is served, so whole payloads go out one after the
+ * other in arrival order. A process that dies holding or awaiting its turn
+ * is noticed by the ones waiting behind it and skipped.
+ */
+#ifndef KBINSERT_QUEUE_H
+#define KBINSERT_QUEUE_H
+
+#include <stdint.h>
+
+struct queue_turn {
+    uint32_t ticket;
+    int held;
+    unsigned ahead;             // payloads queued before ours
+    long long wait_ns;          // how long we waited for our turn
+};
+
+// Wait for our turn. -1 (with a message) if the queue can't be set up;
+// typing may then go ahead unserialized.
+int queue_enter(struct queue_turn *turn);
+// Let the next one go; no-op unless turn is held
+void queue_leave(struct queue_turn *turn);
+// --queue-stats: what the queue has seen since boot, as text or JSON
+int queue_print_stats(int json);
+
+#endif
@@ -0,0 +1,149 @@
+/* decode_fuzz.c — differential test of kbi_decode_escapes()
+ *
+ * The library's decoder skips escape-free text 16/32 bytes at a time
+ * (SSE2/AVX2) and carries escapes across calls. Here random inputs, heavy
+ * in backslashes and escape characters and with plain runs long enough
+ * for the vector loops, are fed to it in random pieces (empty ones
+ * included) and the result is compared with a byte-at-a-time reference
+ * that sees the whole input at once: the decoder as it was before the
+ * vector scan.
+ *
+ * Usage: decode_fuzz [ITERATIONS [SEED]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "../kbinsert.h"
+
+#define MAX_LEN 600
+
+enum { ESC_NONE, ESC_BSLASH, ESC_CARET, ESC_HEX0, ESC_HEX1, ESC_OCT };
+
+static int hexval(int c) {
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+static size_t ref_decode(const char *in, size_t len, char *out) {
+    int state = ESC_NONE, val = 0, cnt = 0;
+    char hex1 = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = in[i];
+        switch (state) {
+        case ESC_NONE:
+            if (c == '\\') state = ESC_BSLASH;
+            else out[j++] = c;
+            continue;
+        case ESC_BSLASH:
+            state = ESC_NONE;
+            if (c == 'n')      out[j++] = '\n';
+            else if (c == 'r') out[j++] = '\r';
+            else if (c == '^') state = ESC_CARET;
+            else if (c == 'x') state = ESC_HEX0;
+            else if (c >= '0' && c <= '7') { val = c - '0'; cnt = 1; state = ESC_OCT; }
+            else               out[j++] = c;
+            continue;
+        case ESC_CARET:
+            state = ESC_NONE;
+            c = toupper(c);
+            if (c >= '@' && c <= '_') {
+                out[j++] = c - 64;
+            } else {
+                out[j++] = '^';
+                out[j++] = c;
+            }
+            continue;
+        case ESC_HEX0:
+            if (isxdigit(c)) { hex1 = c; state = ESC_HEX1; continue; }
+            out[j++] = 'x';
+            break;
+        case ESC_HEX1:
+            if (isxdigit(c)) {
+                out[j++] = (char)(hexval(hex1) * 16 + hexval(c));
+                state = ESC_NONE;
+                continue;
+            }
+            out[j++] = 'x';
+            out[j++] = hex1;
+            break;
+        case ESC_OCT:
+            if (c >= '0' && c <= '7') {
+                val = val * 8 + (c - '0');
+                if (++cnt == 3) { out[j++] = (char)val; state = ESC_NONE; }
+                continue;
+            }
+            out[j++] = (char)val;
+            break;
+        }
+        state = ESC_NONE;
+        i--;
+    }
+    switch (state) {
+    case ESC_BSLASH: out[j++] = '\\'; break;
+    case ESC_CARET:  out[j++] = '^'; break;
+    case ESC_HEX0:   out[j++] = 'x'; break;
+    case ESC_HEX1:   out[j++] = 'x'; out[j++] = hex1; break;
+    case ESC_OCT:    out[j++] = (char)val; break;
+    }
+    return j;
+}
+
+// Mostly the bytes escapes are made of; now and then a long plain run
+static size_t random_input(char *buf) {
+    static const char alphabet[] = "\\\\\\\\nrx^@_?0178aAfFgG9 ~";
+    size_t len = rand() % (MAX_LEN + 1), i = 0;
+    while (i < len) {
+        if (rand() % 8 == 0) {
+            size_t run = rand() % 80;
+            for (; run-- && i < len; i++) buf[i] = 'a' + rand() % 26;
+        } else {
+            int r = rand() % 16;
+            buf[i++] = r == 0 ? (char)(rand() % 256) : alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+    }
+    return len;
+}
+
+static void dump(const char *what, const char *p, size_t len) {
+    fprintf(stderr, "%s (%zu):", what, len);
+    for (size_t i = 0; i < len; i++) fprintf(stderr, " %02x", (unsigned char)p[i]);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    unsigned seed = argc > 2 ? (unsigned)atol(argv[2]) : 1;
+    static char in[MAX_LEN], want[MAX_LEN + 4], got[2 * MAX_LEN + 64];
+    srand(seed);
+    for (long n = 0; n < iterations; n++) {
+        size_t len = random_input(in);
+        size_t wlen = ref_decode(in, len, want);
+
+        // Random pieces; each call may add up to 4 bytes beyond its input
+        struct kbi_esc st = {0};
+        size_t off = 0, glen = 0, cuts[MAX_LEN + 1];
+        int ncuts = 0;
+        while (off < len) {
+            size_t piece = rand() % 4 == 0 ? rand() % 3 : rand() % (len - off + 1);
+            if (piece > len - off || ncuts == MAX_LEN) piece = len - off;
+            cuts[ncuts++] = piece;
+            glen += kbi_decode_escapes(&st, in + off, piece, got + glen, 0);
+            off += piece;
+        }
+        glen += kbi_decode_escapes(&st, "", 0, got + glen, 1);
+
+        if (glen != wlen || memcmp(got, want, wlen) != 0) {
+            fprintf(stderr, "decode_fuzz: mismatch at iteration %ld (seed %u)\n", n, seed);
+            dump("input", in, len);
+            fprintf(stderr, "pieces:");
+            for (int i = 0; i < ncuts; i++) fprintf(stderr, " %zu", cuts[i]);
+            fprintf(stderr, "\n");
+            dump("expected", want, wlen);
+            dump("decoded", got, glen);
+            return 1;
+        }
+    }
+    printf("decode_fuzz: %ld inputs decoded alike (seed %u)\n", iterations, seed);
+    return 0;
+}
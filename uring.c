@@ -0,0 +1,122 @@
+/* uring.c — minimal io_uring wrapper (see uring.h)
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Does the kernel let an expired timeout continue its link chain?
+static int probe_etime_success(struct uring *u) {
+    struct __kernel_timespec ts = { 0, 0 };
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    struct io_uring_cqe cqe;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+    if (uring_submit(u, 1) < 0 || uring_cqe(u, &cqe) < 0) return 0;
+    return cqe.res == -ETIME;
+}
+
+int uring_init(struct uring *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    u->sq_entries = p.sq_entries;
+    u->cq_entries = p.cq_entries;
+
+    // With SINGLE_MMAP the SQ and CQ rings share one mapping
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > u->sq_map_len) u->sq_map_len = cq_len;
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) goto fail;
+    u->cq_map = u->sq_map;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->sq_map, u->sq_map_len);
+        goto fail;
+    }
+
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_local_tail = *u->sq_tail;
+
+    if (!probe_etime_success(u)) {
+        uring_free(u);
+        errno = ENOSYS;
+        return -1;
+    }
+    return 0;
+
+fail:
+    close(u->fd);
+    u->fd = -1;
+    return -1;
+}
+
+void uring_free(struct uring *u) {
+    if (u->fd < 0) return;
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->sq_map, u->sq_map_len);
+    close(u->fd);
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local_tail - head >= u->sq_entries) return NULL;
+    unsigned idx = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+int uring_submit(struct uring *u, unsigned wait_nr) {
+    unsigned tail = *u->sq_tail;
+    unsigned n = u->sq_local_tail - tail;
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    int rc;
+    while ((rc = sys_enter(u->fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0)) < 0
+           && errno == EINTR)
+        ;
+    return rc;
+}
+
+int uring_cqe(struct uring *u, struct io_uring_cqe *cqe) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return -1;
+    *cqe = u->cqes[head & *u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
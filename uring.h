@@ -0,0 +1,40 @@
+/* uring.h — a minimal io_uring wrapper for kbinsert, on raw syscalls
+ *
+ * Just enough to queue SQEs, submit them and reap CQEs; no liburing
+ * needed. Linux 5.16+ is required for the linked pacing timeouts
+ * (IORING_TIMEOUT_ETIME_SUCCESS), which uring_init() checks for.
+ */
+#ifndef KBINSERT_URING_H
+#define KBINSERT_URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned sq_entries, cq_entries;
+    // SQ ring
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;         // queued but not yet published
+    // CQ ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+// Set up a ring of entries SQEs; returns 0, or -1 with errno set if
+// io_uring is missing, disabled or too old
+int uring_init(struct uring *u, unsigned entries);
+void uring_free(struct uring *u);
+
+// Next free SQE (zeroed), or NULL if the queue is full
+struct io_uring_sqe *uring_sqe(struct uring *u);
+// Submit everything queued and wait for at least wait_nr completions.
+// Returns the number submitted, or -1 with errno set.
+int uring_submit(struct uring *u, unsigned wait_nr);
+// Pop one completion into *cqe; returns 0, or -1 if none is ready
+int uring_cqe(struct uring *u, struct io_uring_cqe *cqe);
+
+#endif
@@ -0,0 +1,243 @@
+/* x11.c — XTest typing for kbinsert (see x11.h)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include "x11.h"
+
+// The few Xlib/XTest types and keysyms we use (no headers needed)
+typedef struct _XDisplay Display;
+typedef unsigned long KeySym;
+typedef unsigned char KeyCode;
+#define NoSymbol        0UL
+#define XK_BackSpace    0xff08
+#define XK_Tab          0xff09
+#define XK_Return       0xff0d
+#define XK_Escape       0xff1b
+#define XK_Shift_L      0xffe1
+#define XK_Control_L    0xffe3
+
+static struct {
+    void *xlib, *xtst;
+    Display *(*OpenDisplay)(const char *name);
+    int (*CloseDisplay)(Display *d);
+    int (*Flush)(Display *d);
+    int (*Sync)(Display *d, int discard);
+    int (*DisplayKeycodes)(Display *d, int *min, int *max);
+    KeySym *(*GetKeyboardMapping)(Display *d, KeyCode first, int count, int *per);
+    int (*ChangeKeyboardMapping)(Display *d, int first, int per, KeySym *syms, int count);
+    KeyCode (*KeysymToKeycode)(Display *d, KeySym sym);
+    int (*Free)(void *p);
+    int (*FakeKeyEvent)(Display *d, unsigned code, int press, unsigned long delay);
+} X;
+
+static int x11_load(void) {
+    if (X.xtst) return 0;
+    if (!(X.xlib = dlopen("libX11.so.6", RTLD_NOW | RTLD_LOCAL))) return -1;
+    if (!(X.xtst = dlopen("libXtst.so.6", RTLD_NOW | RTLD_LOCAL))) goto fail;
+#define SYM(lib, field, name) if (!(*(void **)&X.field = dlsym(X.lib, name))) goto fail
+    SYM(xlib, OpenDisplay, "XOpenDisplay");
+    SYM(xlib, CloseDisplay, "XCloseDisplay");
+    SYM(xlib, Flush, "XFlush");
+    SYM(xlib, Sync, "XSync");
+    SYM(xlib, DisplayKeycodes, "XDisplayKeycodes");
+    SYM(xlib, GetKeyboardMapping, "XGetKeyboardMapping");
+    SYM(xlib, ChangeKeyboardMapping, "XChangeKeyboardMapping");
+    SYM(xlib, KeysymToKeycode, "XKeysymToKeycode");
+    SYM(xlib, Free, "XFree");
+    SYM(xtst, FakeKeyEvent, "XTestFakeKeyEvent");
+#undef SYM
+    return 0;
+fail:
+    if (X.xtst) dlclose(X.xtst);
+    dlclose(X.xlib);
+    memset(&X, 0, sizeof(X));
+    return -1;
+}
+
+/* Latin-1 and control characters come from a byte table built with the
+ * keymap (first key found, on the first two levels: plain and Shift).
+ * Everything else is looked up once per codepoint and cached; characters
+ * with no key are put on spare (unmapped) keycodes, taken round-robin so
+ * the last few stay valid while clients catch up with the MappingNotify.
+ */
+#define X11_CP_CACHE    256
+#define X11_SPARES      8
+#define X11_FLUSH       64          // strokes queued per XFlush()
+#define X11_RESTORE_US  50000       // grace before spares are unmapped again
+
+enum { X_SHIFT = 1, X_CTRL = 2 };
+struct x11_key { KeyCode code; unsigned char mods; };
+
+struct x11 {
+    Display *d;
+    unsigned long delay_ms;
+    KeySym *syms;
+    int min, max, per;
+    KeyCode shift, ctrl;
+    struct x11_key byte[256];
+    struct { uint32_t cp; struct x11_key key; } cache[X11_CP_CACHE];
+    KeyCode spare[X11_SPARES];
+    int nspare, next_spare, remapped;
+    uint32_t u8cp;                  // UTF-8 character being assembled
+    int u8need;
+    int pending;                    // strokes since the last flush
+};
+
+static void build_table(struct x11 *x) {
+    for (int kc = x->min; kc <= x->max; kc++) {
+        const KeySym *ks = x->syms + (kc - x->min) * x->per;
+        int used = 0;
+        for (int i = 0; i < x->per; i++) used |= ks[i] != NoSymbol;
+        if (!used && x->nspare < X11_SPARES) x->spare[x->nspare++] = kc;
+        for (int i = 0; i < 2 && i < x->per; i++) {
+            int c = ks[i] == XK_Return ? '\n' : ks[i] == XK_Tab ? '\t'
+                  : ks[i] == XK_BackSpace ? '\b' : ks[i] == XK_Escape ? 0x1b
+                  : (ks[i] >= 0x20 && ks[i] < 0x7f) || (ks[i] >= 0xa0 && ks[i] < 0x100) ? (int)ks[i]
+                  : -1;
+            if (c >= 0 && !x->byte[c].code)
+                x->byte[c] = (struct x11_key){ kc, i ? X_SHIFT : 0 };
+        }
+    }
+    if (!x->byte['\r'].code) x->byte['\r'] = x->byte['\n'];
+    // Other control characters are Ctrl+letter
+    for (int c = 1; c <= 26; c++)
+        if (!x->byte[c].code && x->byte['a' + c - 1].code)
+            x->byte[c] = (struct x11_key){ x->byte['a' + c - 1].code, X_CTRL };
+    x->shift = X.KeysymToKeycode(x->d, XK_Shift_L);
+    x->ctrl = X.KeysymToKeycode(x->d, XK_Control_L);
+    for (int i = 0; i < X11_CP_CACHE; i++) x->cache[i].cp = UINT32_MAX;
+}
+
+// Map the next spare keycode to sym (both levels, so Shift can't matter)
+static int remap(struct x11 *x, KeySym sym, struct x11_key *k) {
+    if (!x->nspare) return -1;
+    KeyCode kc = x->spare[x->next_spare++ % x->nspare];
+    for (int i = 0; i < X11_CP_CACHE; i++)
+        if (x->cache[i].key.code == kc) x->cache[i].cp = UINT32_MAX;
+    KeySym syms[2] = { sym, sym };
+    X.ChangeKeyboardMapping(x->d, kc, 2, syms, 1);
+    X.Sync(x->d, 0);
+    x->remapped = 1;
+    *k = (struct x11_key){ kc, 0 };
+    return 0;
+}
+
+// Key for cp (code 0: none). Only Unicode keysyms are matched in the
+// keymap; characters a layout has under a legacy keysym get a spare.
+static struct x11_key key_for(struct x11 *x, uint32_t cp) {
+    if (cp < 256 && x->byte[cp].code) return x->byte[cp];
+    struct x11_key none = { 0, 0 };
+    if (cp < 0x20 || cp == 0x7f) return none;
+    unsigned slot = cp % X11_CP_CACHE;
+    if (x->cache[slot].cp == cp) return x->cache[slot].key;
+    KeySym sym = cp < 0x100 ? cp : 0x1000000 | cp;
+    struct x11_key k = none;
+    for (int kc = x->min; kc <= x->max && !k.code; kc++)
+        for (int i = 0; i < 2 && i < x->per; i++)
+            if (x->syms[(kc - x->min) * x->per + i] == sym) {
+                k = (struct x11_key){ kc, i ? X_SHIFT : 0 };
+                break;
+            }
+    if (!k.code) remap(x, sym, &k);
+    x->cache[slot].cp = cp;
+    x->cache[slot].key = k;
+    return k;
+}
+
+static void stroke(struct x11 *x, struct x11_key k) {
+    // Only a stroke's first event is delayed; the rest follow it at once
+    unsigned long delay = x->delay_ms;
+    if (k.mods & X_CTRL)  { X.FakeKeyEvent(x->d, x->ctrl, 1, delay); delay = 0; }
+    if (k.mods & X_SHIFT) { X.FakeKeyEvent(x->d, x->shift, 1, delay); delay = 0; }
+    X.FakeKeyEvent(x->d, k.code, 1, delay);
+    X.FakeKeyEvent(x->d, k.code, 0, 0);
+    if (k.mods & X_SHIFT) X.FakeKeyEvent(x->d, x->shift, 0, 0);
+    if (k.mods & X_CTRL)  X.FakeKeyEvent(x->d, x->ctrl, 0, 0);
+    if (++x->pending >= X11_FLUSH) {
+        X.Flush(x->d);
+        x->pending = 0;
+    }
+}
+
+int x11_probe(void) {
+    const char *disp = getenv("DISPLAY");
+    if (!disp || !*disp || x11_load() < 0) return -1;
+    Display *d = X.OpenDisplay(NULL);
+    if (!d) return -1;
+    X.CloseDisplay(d);
+    return 0;
+}
+
+struct x11 *x11_open(unsigned delay_ms) {
+    if (x11_load() < 0) {
+        fprintf(stderr, "kbinsert: x11: can't load libX11/libXtst (%s)\n", dlerror());
+        return NULL;
+    }
+    struct x11 *x = calloc(1, sizeof(*x));
+    if (!x) return NULL;
+    if (!(x->d = X.OpenDisplay(NULL))) {
+        fprintf(stderr, "kbinsert: x11: cannot open display %s\n", getenv("DISPLAY") ? getenv("DISPLAY") : "(unset)");
+        free(x);
+        return NULL;
+    }
+    X.DisplayKeycodes(x->d, &x->min, &x->max);
+    x->syms = X.GetKeyboardMapping(x->d, x->min, x->max - x->min + 1, &x->per);
+    if (!x->syms) {
+        fprintf(stderr, "kbinsert: x11: cannot read the keyboard mapping\n");
+        X.CloseDisplay(x->d);
+        free(x);
+        return NULL;
+    }
+    x->delay_ms = delay_ms;
+    build_table(x);
+    return x;
+}
+
+long x11_type(struct x11 *x, const char *text, size_t len) {
+    long typed = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        uint32_t cp;
+        if (c < 0x80) {
+            x->u8need = 0;
+            cp = c;
+        } else if (c >= 0xc2 && c <= 0xf4) {        // lead byte
+            x->u8need = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+            x->u8cp = c & (0x3f >> x->u8need);
+            continue;
+        } else if (c >= 0xc0 || !x->u8need) {       // invalid or stray continuation
+            x->u8need = 0;
+            continue;
+        } else {
+            x->u8cp = x->u8cp << 6 | (c & 0x3f);
+            if (--x->u8need > 0) continue;
+            cp = x->u8cp;
+        }
+        struct x11_key k = key_for(x, cp);
+        if (!k.code) continue;
+        stroke(x, k);
+        typed++;
+    }
+    return typed;
+}
+
+void x11_close(struct x11 *x) {
+    if (!x) return;
+    X.Sync(x->d, 0);
+    if (x->remapped) {
+        // Let clients read the last keys while the mapping still holds
+        usleep(X11_RESTORE_US);
+        KeySym none[2] = { NoSymbol, NoSymbol };
+        for (int i = 0; i < x->nspare; i++)
+            X.ChangeKeyboardMapping(x->d, x->spare[i], 2, none, 1);
+        X.Sync(x->d, 0);
+    }
+    X.Free(x->syms);
+    X.CloseDisplay(x->d);
+    free(x);
+}
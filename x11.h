@@ -0,0 +1,28 @@
+/* x11.h — typing through XTest on $DISPLAY, for kbinsert's x11 backend
+ *
+ * libX11 and libXtst are dlopen()ed when first needed, so kbinsert neither
+ * links against them nor needs their headers to build. The keyboard
+ * mapping is read once per connection; characters it has no key for are
+ * put on a spare keycode for the rest of the connection, and every key is
+ * queued and flushed to the server in batches.
+ */
+#ifndef KBINSERT_X11_H
+#define KBINSERT_X11_H
+
+#include <stddef.h>
+
+struct x11;
+
+// 0 if the libraries load and $DISPLAY accepts a connection
+int x11_probe(void);
+// Connect and read the keymap; the server waits delay_ms before each key
+// (0: as fast as it takes them). NULL, with a message, on failure.
+struct x11 *x11_open(unsigned delay_ms);
+// Queue the keys for UTF-8 text (sequences may span calls); returns the
+// number of characters queued (ones with no way to type them are skipped)
+long x11_type(struct x11 *x, const char *text, size_t len);
+// Wait until the server has played everything, undo remapped keycodes
+// and disconnect
+void x11_close(struct x11 *x);
+
+#endif